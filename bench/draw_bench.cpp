@@ -0,0 +1,264 @@
+#include "draw.h"
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Builds against either backend (see the bench target in the Makefile) and
+// draws over a window it creates itself, so it only needs an X server such
+// as Xvfb. Timings cover the client side plus whatever round trips the
+// backend itself makes in endFrame. Damage tracking is off, so both
+// backends repaint and present whole frames.
+
+namespace
+{
+    const char* BENCH_CLASS = "DrawBench";
+    const int LABELS_PER_FRAME = 16;
+
+    Display* target_display = nullptr;
+    Window target_window = 0;
+
+    bool createTargetWindow(int width, int height)
+    {
+        target_display = XOpenDisplay(nullptr);
+        if (!target_display)
+        {
+            std::cerr << "Cannot open display, is Xvfb running?" << std::endl;
+            return false;
+        }
+
+        int screen = DefaultScreen(target_display);
+        target_window = XCreateSimpleWindow(target_display, RootWindow(target_display, screen), 0, 0, width, height,
+                                            0, BlackPixel(target_display, screen), BlackPixel(target_display, screen));
+
+        XClassHint class_hint;
+        class_hint.res_name = const_cast<char*>(BENCH_CLASS);
+        class_hint.res_class = const_cast<char*>(BENCH_CLASS);
+        XSetClassHint(target_display, target_window, &class_hint);
+        XMapWindow(target_display, target_window);
+        XSync(target_display, False);
+        return true;
+    }
+
+    // Waits until the overlay has caught up with the target's size
+    bool resizeTarget(int width, int height)
+    {
+        if (Overlay::getWidth() == width && Overlay::getHeight() == height)
+            return true;
+
+        XResizeWindow(target_display, target_window, width, height);
+        XSync(target_display, False);
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            Overlay::updateWindowPosition();
+            if (Overlay::getWidth() == width && Overlay::getHeight() == height)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return false;
+    }
+
+    std::string labelText(bool cold, int index, long long iteration)
+    {
+        // Cold text never repeats, so every call misses the text caches
+        std::string text = "Label " + std::to_string(index);
+        if (cold)
+            text += " #" + std::to_string(iteration);
+        return text;
+    }
+
+    void BM_GetTextSize(benchmark::State& state)
+    {
+        bool cold = state.range(0) != 0;
+        long long iteration = 0;
+        int width = 0, height = 0;
+        for (auto _ : state)
+        {
+            width = 0;
+            height = 0;
+            Draw::getTextSize(labelText(cold, 0, iteration++), &width, &height, "Courier New", 18);
+            benchmark::DoNotOptimize(width);
+        }
+        if (width <= 0 || height <= 0)
+            state.SkipWithError("getTextSize returned no size, nothing was measured");
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_GetTextSize)->ArgName("cold")->Arg(0)->Arg(1);
+
+    void drawLabel(Draw::TextStyle style, const std::string& text, int x, int y)
+    {
+        switch (style)
+        {
+        case Draw::STYLE_PLAIN:
+            Draw::drawStringPlain(text, x, y, 1.0, 1.0, 1.0);
+            break;
+        case Draw::STYLE_OUTLINE:
+            Draw::drawStringOutline(text, x, y, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 2.0);
+            break;
+        case Draw::STYLE_BACKGROUND:
+            Draw::drawStringBackground(text, x, y, 1.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.6, 4);
+            break;
+        }
+    }
+
+    // One frame of LABELS_PER_FRAME labels in the given style
+    template <Draw::TextStyle Style>
+    void BM_DrawString(benchmark::State& state)
+    {
+        bool cold = state.range(0) != 0;
+        if (!resizeTarget(1280, 720))
+        {
+            state.SkipWithError("overlay did not follow the target resize");
+            return;
+        }
+
+        long long iteration = 0;
+        for (auto _ : state)
+        {
+            Overlay::beginFrame();
+            for (int i = 0; i < LABELS_PER_FRAME; i++)
+                drawLabel(Style, labelText(cold, i, iteration), 20 + (i % 4) * 300, 20 + (i / 4) * 160);
+            Overlay::endFrame();
+            iteration++;
+        }
+        state.SetItemsProcessed(state.iterations() * LABELS_PER_FRAME);
+    }
+    BENCHMARK_TEMPLATE(BM_DrawString, Draw::STYLE_PLAIN)->ArgName("cold")->Arg(0)->Arg(1);
+    BENCHMARK_TEMPLATE(BM_DrawString, Draw::STYLE_OUTLINE)->ArgName("cold")->Arg(0)->Arg(1);
+    BENCHMARK_TEMPLATE(BM_DrawString, Draw::STYLE_BACKGROUND)->ArgName("cold")->Arg(0)->Arg(1);
+
+    // The same labels every frame, drawn with and without the label texture
+    // cache; with it every label after the first frames is a single blit
+    void BM_StaticLabels(benchmark::State& state)
+    {
+        bool cached = state.range(0) != 0;
+        if (!resizeTarget(1280, 720))
+        {
+            state.SkipWithError("overlay did not follow the target resize");
+            return;
+        }
+
+        // Unchanged labels must still be repainted for the comparison to mean anything
+        Overlay::setDamageTracking(false);
+        Overlay::LabelCacheStats defaults = Overlay::getLabelCacheStats();
+        Overlay::setLabelCacheBudget(cached ? defaults.budget : 0);
+        for (auto _ : state)
+        {
+            Overlay::beginFrame();
+            for (int i = 0; i < LABELS_PER_FRAME; i++)
+                drawLabel(static_cast<Draw::TextStyle>(i % 3), labelText(false, i, 0), 20 + (i % 4) * 300,
+                          20 + (i / 4) * 160);
+            Overlay::endFrame();
+        }
+        unsigned long long hits = Overlay::getLabelCacheStats().hits - defaults.hits;
+        Overlay::setLabelCacheBudget(defaults.budget);
+
+        if (cached && state.iterations() > 2 && hits == 0)
+            state.SkipWithError("label cache never hit, labels were not served from textures");
+        state.counters["cache_hits"] = static_cast<double>(hits);
+        state.SetItemsProcessed(state.iterations() * LABELS_PER_FRAME);
+    }
+    BENCHMARK(BM_StaticLabels)->ArgName("cached")->Arg(0)->Arg(1);
+
+    // Frame overhead alone: an empty frame, and one that moves a single label
+    // so there is always something to clear and present
+    void BM_Frame(benchmark::State& state)
+    {
+        int width = static_cast<int>(state.range(0));
+        int height = static_cast<int>(state.range(1));
+        bool with_label = state.range(2) != 0;
+        if (!resizeTarget(width, height))
+        {
+            state.SkipWithError("overlay did not follow the target resize");
+            return;
+        }
+
+        int x = 0;
+        for (auto _ : state)
+        {
+            Overlay::beginFrame();
+            if (with_label)
+                Draw::drawStringPlain("Frame", x, height / 2, 1.0, 1.0, 1.0);
+            Overlay::endFrame();
+            x = (x + 7) % (width / 2);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_Frame)
+        ->ArgNames({"width", "height", "label"})
+        ->Args({640, 480, 0})
+        ->Args({640, 480, 1})
+        ->Args({1280, 720, 0})
+        ->Args({1280, 720, 1})
+        ->Args({1920, 1080, 0})
+        ->Args({1920, 1080, 1})
+        ->Args({3840, 2160, 0})
+        ->Args({3840, 2160, 1});
+
+    // Rasterization scaling: a 4K frame of large outlined labels spread over
+    // every band. Only the Cairo backend splits the work, Xft is a baseline.
+    void BM_RasterThreads(benchmark::State& state)
+    {
+        int threads = static_cast<int>(state.range(0));
+        if (!resizeTarget(3840, 2160))
+        {
+            state.SkipWithError("overlay did not follow the target resize");
+            return;
+        }
+
+        Overlay::setRasterThreads(threads);
+        for (auto _ : state)
+        {
+            Overlay::beginFrame();
+            for (int i = 0; i < 64; i++)
+                Draw::drawStringOutline(labelText(false, i, 0), 40 + (i % 8) * 460, 40 + (i / 8) * 260, 1.0, 1.0,
+                                        1.0, 0.0, 0.0, 0.0, 1.0, 3.0, "Sans", 48);
+            Overlay::endFrame();
+        }
+        Overlay::setRasterThreads(1);
+        state.counters["threads"] = threads;
+        state.SetItemsProcessed(state.iterations() * 64);
+    }
+    BENCHMARK(BM_RasterThreads)->ArgName("threads")->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+} // namespace
+
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    if (!createTargetWindow(1280, 720))
+        return 1;
+
+    bool initialized = Overlay::initialize(BENCH_CLASS);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!initialized && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        initialized = Overlay::tryInitialize(BENCH_CLASS);
+    }
+    if (!initialized)
+    {
+        std::cerr << "Overlay failed to attach to the benchmark window" << std::endl;
+        return 1;
+    }
+
+    // Cairo repaints and presents every frame; without this, hot Xft frames
+    // whose labels did not change would send nothing at all
+    Overlay::setDamageTracking(false);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    Overlay::shutdown();
+    XDestroyWindow(target_display, target_window);
+    XCloseDisplay(target_display);
+    return 0;
+}
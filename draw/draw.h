@@ -1,4 +1,7 @@
+#pragma once
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace Draw
 {
@@ -13,12 +16,138 @@ namespace Draw
     void drawStringOutline(const std::string& text, int x, int y, double r, double g, double b, double outline_r, double outline_g, double outline_b, double outline_a, double outline_width, const char* font_family = nullptr, int font_size = 0, TextAlignment alignment = ALIGN_LEFT);
     void drawStringBackground(const std::string& text, int x, int y, double r, double g, double b, double bg_r, double bg_g, double bg_b, double bg_a, int padding, const char* font_family = nullptr, int font_size = 0, TextAlignment alignment = ALIGN_LEFT);
     void getTextSize(const std::string& text, int* width, int* height, const char* font_family = nullptr, int font_size = 0);
+
+    // Retained text elements: created once, mutated through their handle and
+    // painted by drawElements(). Unchanged elements are not laid out again.
+    // Elements are shared by all overlay contexts: drawElements() paints every
+    // visible one into whichever context is current.
+    enum TextStyle
+    {
+        STYLE_PLAIN,
+        STYLE_OUTLINE,
+        STYLE_BACKGROUND
+    };
+
+    struct TextElement
+    {
+        std::string text;
+        int x = 0;
+        int y = 0;
+        double r = 1.0, g = 1.0, b = 1.0;
+        TextStyle style = STYLE_PLAIN;
+        double outline_r = 0.0, outline_g = 0.0, outline_b = 0.0, outline_a = 1.0;
+        double outline_width = 2.0;
+        double bg_r = 0.0, bg_g = 0.0, bg_b = 0.0, bg_a = 0.6;
+        int padding = 4;
+        std::string font_family; // Empty selects the default font
+        int font_size = 0;
+        TextAlignment alignment = ALIGN_LEFT;
+        bool visible = true;
+    };
+
+    typedef unsigned int ElementHandle;
+    const ElementHandle INVALID_ELEMENT = 0;
+
+    ElementHandle createTextElement(const TextElement& element);
+    void destroyTextElement(ElementHandle handle);
+    void setElementText(ElementHandle handle, const std::string& text);
+    void setElementPosition(ElementHandle handle, int x, int y);
+    void setElementColor(ElementHandle handle, double r, double g, double b);
+    void setElementVisible(ElementHandle handle, bool visible);
+    void getElementSize(ElementHandle handle, int* width, int* height);
+    void drawElements();
 } // namespace Draw
 
 namespace Overlay
 {
+    enum TrackingMode
+    {
+        TRACK_POLLING, // Query target geometry every frame
+        TRACK_EVENTS   // Follow ConfigureNotify/DestroyNotify, query only on change
+    };
+
+    struct DamageStats
+    {
+        long long frame_pixels;   // Pixels in the overlay
+        long long damaged_pixels; // Pixels cleared, redrawn and presented in the last frame
+        int damage_rects;
+    };
+
+    // Text layout cache: shaped PangoLayouts (Cairo) or text metrics (Xft)
+    struct TextCacheStats
+    {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        unsigned long entries;
+        unsigned long capacity;
+    };
+
+    // Label texture cache: labels drawn again with the same text, font and
+    // style are composited from a pre-rendered bitmap instead of rasterized.
+    // A label's first draw only records a hash of it in a short list of its
+    // own and is rasterized directly, so text that changes every frame never
+    // takes up texture memory; the second draw creates the texture.
+    struct LabelCacheStats
+    {
+        unsigned long long hits; // Draws served by a single blit
+        unsigned long long misses;
+        unsigned long long evictions;
+        unsigned long entries;
+        unsigned long bytes;  // Pixel and key memory held by the cache
+        unsigned long budget;
+    };
+
+    // Frame instrumentation. Times are in microseconds and phases are
+    // exclusive: text layout done while drawing counts only as text layout.
+    enum FrameMetric
+    {
+        METRIC_FRAME,       // beginFrame to the end of endFrame
+        METRIC_GEOMETRY,    // updateWindowPosition
+        METRIC_CLEAR,
+        METRIC_DRAW_PLAIN,
+        METRIC_DRAW_OUTLINE,
+        METRIC_DRAW_BACKGROUND,
+        METRIC_TEXT_LAYOUT,
+        METRIC_RASTER,      // Tiled rasterization on the worker pool (Cairo)
+        METRIC_PRESENT,
+        METRIC_X_REQUESTS,  // Requests sent per frame
+        METRIC_ROUND_TRIPS, // Calls per frame that waited on the server
+        METRIC_COUNT
+    };
+
+    struct MetricSummary
+    {
+        unsigned long long samples; // Frames since the last reset
+        double mean;
+        double p50;
+        double p99;
+        double max;
+    };
+
+    struct FontRequest
+    {
+        std::string family; // Empty selects the default font
+        int size;           // 0 selects the default size
+    };
+
+    struct PreloadStatus
+    {
+        int requested; // Fonts passed to preloadFonts
+        int resolved;  // Matched by the background thread
+        int ready;     // Opened and warmed up on the render thread
+    };
+
     bool initialize(const char* window_class);
     void shutdown();
+
+    // Headless mode: no target or overlay window, frames are rendered into an
+    // offscreen buffer of the given size. The Cairo backend needs no X server
+    // at all, the Xft backend draws into a pixmap (e.g. on Xvfb).
+    bool initializeHeadless(int width, int height);
+    // Last rendered frame as premultiplied ARGB32 (0xAARRGGBB), row by row
+    bool readPixels(std::vector<unsigned int>& pixels, int* width, int* height);
+    bool writePng(const char* path);
     void beginFrame();
     void endFrame();
     void updateWindowPosition();
@@ -27,4 +156,70 @@ namespace Overlay
     bool isInitialized();
     void cleanup();
     bool tryInitialize(const char* window_class);
+    void setTrackingMode(TrackingMode mode);
+    void setDamageTracking(bool enabled);
+    void setSharedMemoryPresent(bool enabled);
+    // Cairo backend: Draw calls are recorded as glyph runs and rasterized at
+    // endFrame in horizontal bands on this many threads, the calling one
+    // included. 1 (the default) paints on the calling thread as it goes.
+    void setRasterThreads(int threads);
+    int getConnectionNumber(); // X connection fd, -1 without a display
+    bool hasQueuedEvents();    // Events Xlib has read but not yet handed out
+
+    // Several overlays in one process: every context follows its own target
+    // but they share the display connection, fonts, glyphs and colours. The
+    // functions above act on the current context; DEFAULT_CONTEXT always
+    // exists and is the current one unless another is selected.
+    typedef unsigned int ContextHandle;
+    const ContextHandle DEFAULT_CONTEXT = 0;
+    const ContextHandle INVALID_CONTEXT = ~0u;
+
+    ContextHandle createContext(const char* window_class);
+    ContextHandle createContextForWindow(unsigned long window_id);
+    void destroyContext(ContextHandle context); // Falls back to DEFAULT_CONTEXT if it was current
+    bool setCurrentContext(ContextHandle context);
+    ContextHandle getCurrentContext();
+    std::vector<ContextHandle> getContexts();
+    // One pass over every context: attaches to targets that appeared, follows
+    // geometry, and runs beginFrame/draw/endFrame for each initialized one with
+    // it current, flushing the connection once at the end. The frame stats
+    // count the pass as one frame. draw must not create or destroy contexts.
+    void renderContexts(const std::function<void(ContextHandle)>& draw);
+
+    // Frame pacing: waitForNextFrame sleeps until the next absolute deadline at
+    // the target rate, or at the idle rate while nothing marked the content
+    // dirty. An idle rate of 0 sleeps until X input or markDirty.
+    void setTargetFps(double fps);
+    void setIdleFps(double fps);
+    void markDirty();
+    void waitForNextFrame();
+    // Threaded mode: a render thread owns the X connection and runs the frame
+    // loop for window_class. Draw::drawString* calls from any other thread go
+    // into that thread's own queue without locks or X requests; submitFrame
+    // publishes them as the thread's latest complete frame, which is drawn
+    // every frame until replaced. getTextSize and the element API are not
+    // available to producer threads.
+    bool startRenderThread(const char* window_class);
+    void stopRenderThread();
+    bool isRenderThreadRunning();
+    void submitFrame();
+    DamageStats getDamageStats();
+
+    // Disabled by default. Enabling or setting a dump path starts recording;
+    // the dump appends one JSON line per interval and then resets the stats.
+    void setFrameStatsEnabled(bool enabled);
+    MetricSummary getFrameMetric(FrameMetric metric);
+    void resetFrameStats();
+    bool setFrameStatsDump(const char* path, double interval_seconds); // Null path stops dumping
+    void setTextCacheCapacity(unsigned long entries);
+
+    // Matches fonts on a background thread. Fonts matched by the time the
+    // overlay initializes are opened and have `characters` rasterized before
+    // its first frame; later ones are opened one per frame. Nothing waits
+    // for the matching, so call this well before the target appears
+    void preloadFonts(const std::vector<FontRequest>& fonts, const std::string& characters = "");
+    PreloadStatus getPreloadStatus();
+    TextCacheStats getTextCacheStats();
+    void setLabelCacheBudget(unsigned long bytes); // 0 disables the cache and frees it
+    LabelCacheStats getLabelCacheStats();
 } // namespace Overlay
\ No newline at end of file
@@ -1,35 +1,203 @@
 #include "draw.h"
+#include "font_preload.h"
+#include "frame_stats.h"
+#include "pixel_ops.h"
+#include "render_queue.h"
+#include "worker_pool.h"
+#include <X11/Xatom.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/shape.h>
 #include <cairo/cairo-xlib.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <list>
+#include <map>
 #include <pango/pangocairo.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #define BASIC_EVENT_MASK (StructureNotifyMask | ExposureMask | PropertyChangeMask)
 #define NOT_PROPAGATE_MASK (KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask)
 
 namespace
 {
-    cairo_t* current_cr = nullptr;
-
+    // Shared by every overlay context
     Display* display = nullptr;
-    Window target_window = 0;
-    Window overlay_window = 0;
     Colormap colormap = 0;
-
-    cairo_surface_t* cairo_surface = nullptr;
-    cairo_surface_t* offscreen_surface = nullptr;
-    cairo_t* cr = nullptr;
-
-    int width = 0;
-    int height = 0;
-    int pos_x = 0;
-    int pos_y = 0;
-
-    bool overlay_initialized = false;
-    std::string current_window_class;
+    Visual* visual = nullptr;
+    PangoContext* pango_context = nullptr; // Shared by every layout
     bool x_error_occurred = false;
+    Overlay::TrackingMode tracking_mode = Overlay::TRACK_EVENTS;
+
+    // Target discovery: _NET_CLIENT_LIST first, then root PropertyNotify/MapNotify
+    // tell us when something new could match, instead of rescanning on a timer
+    Atom net_client_list = None;
+    bool discovery_watching = false;
+    bool have_client_list = false;      // Window manager publishes _NET_CLIENT_LIST
+
+    // MIT-SHM presentation: the offscreen surface lives in a segment shared
+    // with the server and is presented with XShmPutImage
+    bool shm_enabled = true;
+    bool shm_unavailable = false; // Extension missing or attach refused, e.g. over ssh -X
+    int shm_completion_event = -1;
+
+    // Tiled rasterization: with more than one thread, Draw calls only record
+    // their glyph runs and endFrame paints them band by band on the worker pool
+    int raster_threads = 1;
+    const int TILES_PER_THREAD = 4; // Spare bands even out the ones crowded with text
+    const int MIN_TILE_ROWS = 32;
+
+    struct GlyphRun
+    {
+        cairo_scaled_font_t* font = nullptr; // Referenced until the frame is rasterized
+        size_t first_glyph = 0;
+        size_t glyph_count = 0;
+    };
+
+    // How a label looks, apart from where it goes
+    struct LabelPaint
+    {
+        Draw::TextStyle style = Draw::STYLE_PLAIN;
+        double r = 0, g = 0, b = 0;
+        double extra_r = 0, extra_g = 0, extra_b = 0, extra_a = 0; // Outline or background colour
+        double outline_width = 0;
+        int padding = 0;
+    };
+
+    struct TileCommand
+    {
+        LabelPaint paint;
+        int x = 0; // Top-left of the text
+        int y = 0;
+        int text_width = 0;
+        int text_height = 0;
+        int top = 0; // Rows the command can touch
+        int bottom = 0;
+        size_t first_run = 0;
+        size_t run_count = 0;
+    };
+
+    // One overlay and the target it follows. The display, Pango context,
+    // layout cache and fonts are shared between contexts.
+    struct OverlayContext
+    {
+        Window target_window = 0;
+        Window fixed_window = 0; // Target given by ID instead of discovered by class
+        Window overlay_window = 0;
+
+        cairo_surface_t* cairo_surface = nullptr;
+        cairo_surface_t* offscreen_surface = nullptr;
+        cairo_t* cr = nullptr;         // Drawing context, lives as long as offscreen_surface
+        cairo_t* window_cr = nullptr;  // Presentation context, lives as long as cairo_surface
+        cairo_t* current_cr = nullptr; // Set between beginFrame and endFrame
+        int buffer_width = 0;          // Size offscreen_surface was created at
+        int buffer_height = 0;
+
+        // Bands of offscreen_surface, each an image surface over its rows
+        bool tiled_frame = false;
+        std::vector<cairo_surface_t*> tile_surfaces;
+        std::vector<cairo_t*> tile_crs;
+        std::vector<int> tile_tops;
+        std::vector<TileCommand> tile_commands;
+        std::vector<GlyphRun> tile_runs;
+        std::vector<cairo_glyph_t> tile_glyphs;
+
+        int width = 0;
+        int height = 0;
+        int pos_x = 0;
+        int pos_y = 0;
+
+        bool overlay_initialized = false;
+        bool headless = false; // Rendering into the offscreen surface only, no X at all
+        std::string current_window_class;
+
+        // Event-driven target tracking
+        std::vector<Window> tracked_windows; // Target window and its ancestors below root
+        bool geometry_dirty = false;
+        bool ancestors_dirty = false;
+        bool target_destroyed = false;
+
+        bool discovery_dirty = true;        // Client list changed since the last scan
+        bool discovery_walked = false;      // Full tree walk done for the current class
+        bool discovery_reported = false;
+        std::string discovery_class;
+        std::vector<Window> discovery_candidates;     // Top-level windows mapped since the last scan
+        std::unordered_set<Window> discovery_checked; // Clients known not to match
+
+        Overlay::DamageStats damage_stats{};
+
+        bool shm_active = false;
+        bool shm_busy = false; // Waiting for the server to finish reading the segment
+        XShmSegmentInfo shm_info{};
+        XImage* shm_image = nullptr;
+        GC shm_gc = nullptr;
+    };
+
+    // Map nodes never move, so ctx stays valid until its context is destroyed
+    std::map<Overlay::ContextHandle, OverlayContext> contexts;
+    Overlay::ContextHandle next_context_handle = Overlay::DEFAULT_CONTEXT + 1;
+    OverlayContext* ctx = &contexts[Overlay::DEFAULT_CONTEXT];
+    // Inside renderContexts, endFrame leaves the flush and the frame stats to it
+    bool batching = false;
+
+    // Retained text elements, drawn in creation order
+    struct SceneElement
+    {
+        Draw::TextElement element;
+        PangoLayout* layout = nullptr; // Shaped once, reused until the text changes
+        std::string layout_key;        // What the layout cache would file it under
+        int text_width = 0;
+        int text_height = 0;
+    };
+
+    std::map<Draw::ElementHandle, SceneElement> scene_elements;
+    Draw::ElementHandle next_element_handle = 1;
+
+    // Shaped layouts keyed on (family, size, alignment, text), most recently used first
+    struct LayoutCacheEntry
+    {
+        std::string key;
+        PangoLayout* layout = nullptr;
+        int width = 0;
+        int height = 0;
+    };
+
+    std::list<LayoutCacheEntry> layout_cache;
+    std::unordered_map<std::string, std::list<LayoutCacheEntry>::iterator> layout_cache_index;
+    unsigned long layout_cache_capacity = 256;
+    unsigned long long layout_cache_hits = 0;
+    unsigned long long layout_cache_misses = 0;
+    unsigned long long layout_cache_evictions = 0;
+
+    // Pre-rendered labels keyed on layout and paint, most recently used first
+    struct LabelTexture
+    {
+        std::string key;
+        cairo_surface_t* surface = nullptr; // Null only if the label had nothing to draw
+        int origin_x = 0;                   // Surface corner relative to the text's top-left
+        int origin_y = 0;
+        unsigned long bytes = 0;
+    };
+
+    std::list<LabelTexture> label_cache;
+    std::unordered_map<std::string, std::list<LabelTexture>::iterator> label_cache_index;
+    unsigned long label_cache_budget = 8ul << 20;
+    unsigned long label_cache_bytes = 0;
+    unsigned long long label_cache_hits = 0;
+    unsigned long long label_cache_misses = 0;
+    unsigned long long label_cache_evictions = 0;
+
+    // Hashes of labels drawn once so far, newest first. Only a label found
+    // here gets a texture, and this list is capped on its own
+    const size_t LABEL_SEEN_CAPACITY = 256;
+    std::list<size_t> label_seen;
+    std::unordered_map<size_t, std::list<size_t>::iterator> label_seen_index;
 
     // X error handler
     int xErrorHandler(Display* dpy, XErrorEvent* event)
@@ -108,6 +276,7 @@ namespace
         x_error_occurred = false;
         
         XWindowAttributes attr;
+        FrameStats::countRoundTrip();
         if (!XGetWindowAttributes(display, win, &attr))
         {
             if (!x_error_occurred) {
@@ -123,6 +292,7 @@ namespace
 
         Window child;
         int x, y;
+        FrameStats::countRoundTrip();
         if (!XTranslateCoordinates(display, win, DefaultRootWindow(display), 0, 0, &x, &y, &child))
         {
             if (!x_error_occurred) {
@@ -136,10 +306,10 @@ namespace
             return false;
         }
 
-        pos_x = x;
-        pos_y = y;
-        width = attr.width;
-        height = attr.height;
+        ctx->pos_x = x;
+        ctx->pos_y = y;
+        ctx->width = attr.width;
+        ctx->height = attr.height;
         
         return true;
     }
@@ -160,7 +330,12 @@ namespace
             return;
         }
 
-        colormap = XCreateColormap(display, DefaultRootWindow(display), vinfo.visual, AllocNone);
+        // One ARGB colormap for every overlay, freed at shutdown
+        if (!colormap)
+        {
+            visual = vinfo.visual;
+            colormap = XCreateColormap(display, DefaultRootWindow(display), vinfo.visual, AllocNone);
+        }
         XSetWindowAttributes attr{};
         attr.background_pixmap = None;
         attr.border_pixel = 0;
@@ -171,409 +346,1813 @@ namespace
 
         unsigned long mask = CWColormap | CWBorderPixel | CWEventMask | CWDontPropagate | CWOverrideRedirect;
 
-        overlay_window = XCreateWindow(display, DefaultRootWindow(display), pos_x, pos_y, width, height, 0, vinfo.depth,
-                                       InputOutput, vinfo.visual, mask, &attr);
+        ctx->overlay_window = XCreateWindow(display, DefaultRootWindow(display), ctx->pos_x, ctx->pos_y, ctx->width,
+                                            ctx->height, 0, vinfo.depth, InputOutput, vinfo.visual, mask, &attr);
 
-        XShapeCombineMask(display, overlay_window, ShapeInput, 0, 0, None, ShapeSet);
-        allowInputPassthrough(overlay_window);
-        XMapWindow(display, overlay_window);
+        XShapeCombineMask(display, ctx->overlay_window, ShapeInput, 0, 0, None, ShapeSet);
+        allowInputPassthrough(ctx->overlay_window);
+        XMapWindow(display, ctx->overlay_window);
 
-        cairo_surface = cairo_xlib_surface_create(display, overlay_window, vinfo.visual, width, height);
+        ctx->cairo_surface =
+            cairo_xlib_surface_create(display, ctx->overlay_window, vinfo.visual, ctx->width, ctx->height);
+        ctx->window_cr = cairo_create(ctx->cairo_surface);
+        cairo_set_operator(ctx->window_cr, CAIRO_OPERATOR_SOURCE);
     }
 
-    void ensureOffscreenBuffer()
+    Window shmCompletionDrawable(const XEvent& ev)
+    {
+        return reinterpret_cast<const XShmCompletionEvent&>(ev).drawable;
+    }
+
+    // arg is the overlay window whose completion we are waiting for
+    Bool isShmCompletion(Display*, XEvent* ev, XPointer arg)
+    {
+        return ev->type == shm_completion_event && shmCompletionDrawable(*ev) == *reinterpret_cast<Window*>(arg);
+    }
+
+    // Logged once per display, the next buffer is then a plain image surface
+    void disableShm(const char* reason)
+    {
+        if (!shm_unavailable)
+            std::cerr << "MIT-SHM unavailable (" << reason << "), falling back to XPutImage\n";
+        shm_unavailable = true;
+    }
+
+    void waitForShmCompletion()
     {
-        static int last_width = 0, last_height = 0;
-        if (!offscreen_surface || last_width != width || last_height != height)
+        if (!ctx->shm_busy)
+            return;
+
+        XEvent ev;
+        XPointer window = reinterpret_cast<XPointer>(&ctx->overlay_window);
+        if (XCheckIfEvent(display, &ev, isShmCompletion, window))
         {
-            if (offscreen_surface)
-                cairo_surface_destroy(offscreen_surface);
-            offscreen_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-            last_width = width;
-            last_height = height;
+            ctx->shm_busy = false;
+            return;
         }
+
+        // Once the server has answered a sync it is done with the segment,
+        // so never block on an event that may not come
+        FrameStats::countRoundTrip();
+        XSync(display, False);
+        if (!XCheckIfEvent(display, &ev, isShmCompletion, window))
+            disableShm("no completion event");
+        ctx->shm_busy = false;
     }
 
-    bool checkTargetWindowExists()
+    void drainShmCompletion()
     {
-        if (!display || !target_window)
-            return false;
+        // Used on teardown, where the window may already be gone and the
+        // completion may never come: sync, then take it only if it is queued
+        if (!ctx->shm_busy)
+            return;
 
-        // Reset error flag
-        x_error_occurred = false;
-        
-        // Check if the target window still exists
-        XWindowAttributes attr;
-        if (!XGetWindowAttributes(display, target_window, &attr))
+        FrameStats::countRoundTrip();
+        XSync(display, False);
+        XEvent ev;
+        XCheckIfEvent(display, &ev, isShmCompletion, reinterpret_cast<XPointer>(&ctx->overlay_window));
+        ctx->shm_busy = false;
+    }
+
+    bool createShmBuffer()
+    {
+        if (shm_unavailable)
+            return false;
+        if (!XShmQueryExtension(display))
         {
-            // If we get here and x_error_occurred is true, it means we got a BadWindow error
+            disableShm("extension missing");
             return false;
         }
-        
-        // Check if an X error occurred
-        if (x_error_occurred) {
+
+        ctx->shm_image =
+            XShmCreateImage(display, visual, 32, ZPixmap, nullptr, &ctx->shm_info, ctx->width, ctx->height);
+        if (!ctx->shm_image)
+        {
+            disableShm("XShmCreateImage failed");
             return false;
         }
-        
-        return true;
-    }
 
-    bool initializeOverlayInternal(const char* window_class)
-    {
-        if (!display)
+        ctx->shm_info.shmid =
+            shmget(IPC_PRIVATE, ctx->shm_image->bytes_per_line * ctx->shm_image->height, IPC_CREAT | 0600);
+        if (ctx->shm_info.shmid < 0)
         {
-            // Set up X error handler before opening display
-            XSetErrorHandler(xErrorHandler);
-            
-            display = XOpenDisplay(0);
-            if (!display)
-            {
-                std::cerr << "Failed to open X display" << std::endl;
-                return false;
-            }
+            XDestroyImage(ctx->shm_image);
+            ctx->shm_image = nullptr;
+            disableShm("shmget failed");
+            return false;
         }
 
-        Window found_window = 0;
-        if (!findWindowByClass(DefaultRootWindow(display), window_class, found_window))
+        ctx->shm_info.shmaddr = ctx->shm_image->data = static_cast<char*>(shmat(ctx->shm_info.shmid, nullptr, 0));
+        ctx->shm_info.readOnly = False;
+
+        x_error_occurred = false;
+        if (ctx->shm_info.shmaddr != reinterpret_cast<char*>(-1))
         {
-            std::cout << "Target window with class '" << window_class << "' not found, will retry..." << std::endl;
-            return false;
+            XShmAttach(display, &ctx->shm_info);
+            FrameStats::countRoundTrip();
+            XSync(display, False);
         }
+        // The segment is freed once both sides have detached
+        shmctl(ctx->shm_info.shmid, IPC_RMID, nullptr);
 
-        target_window = found_window;
-        if (!getWindowGeometry(target_window)) {
-            std::cerr << "Failed to get window geometry" << std::endl;
+        if (ctx->shm_info.shmaddr == reinterpret_cast<char*>(-1) || x_error_occurred)
+        {
+            if (ctx->shm_info.shmaddr != reinterpret_cast<char*>(-1))
+                shmdt(ctx->shm_info.shmaddr);
+            ctx->shm_image->data = nullptr;
+            XDestroyImage(ctx->shm_image);
+            ctx->shm_image = nullptr;
+            disableShm("segment could not be attached");
             return false;
         }
-        createOverlayWindow();
 
-        overlay_initialized = true;
-        std::cout << "Overlay initialized successfully for window class: " << window_class << std::endl;
+        if (!ctx->shm_gc)
+            ctx->shm_gc = XCreateGC(display, ctx->overlay_window, 0, nullptr);
+        shm_completion_event = XShmGetEventBase(display) + ShmCompletion;
+
+        ctx->offscreen_surface =
+            cairo_image_surface_create_for_data(reinterpret_cast<unsigned char*>(ctx->shm_image->data),
+                                                CAIRO_FORMAT_ARGB32, ctx->width, ctx->height,
+                                                ctx->shm_image->bytes_per_line);
+        ctx->shm_active = true;
         return true;
     }
 
-    void cleanupOverlayInternal()
+    void clearTileCommands()
     {
-        if (cr)
-        {
-            cairo_destroy(cr);
-            cr = nullptr;
-        }
-        if (cairo_surface)
-        {
-            cairo_surface_destroy(cairo_surface);
-            cairo_surface = nullptr;
-        }
-        if (offscreen_surface)
+        for (GlyphRun& run : ctx->tile_runs)
+            cairo_scaled_font_destroy(run.font);
+        ctx->tile_runs.clear();
+        ctx->tile_commands.clear();
+        ctx->tile_glyphs.clear();
+    }
+
+    void releaseTiles()
+    {
+        clearTileCommands();
+        for (cairo_t* tile_cr : ctx->tile_crs)
+            cairo_destroy(tile_cr);
+        for (cairo_surface_t* surface : ctx->tile_surfaces)
+            cairo_surface_destroy(surface);
+        ctx->tile_crs.clear();
+        ctx->tile_surfaces.clear();
+        ctx->tile_tops.clear();
+    }
+
+    void ensureTiles()
+    {
+        int count = std::max(1, std::min(raster_threads * TILES_PER_THREAD, ctx->height / MIN_TILE_ROWS));
+        if (static_cast<int>(ctx->tile_crs.size()) == count)
+            return;
+
+        releaseTiles();
+        unsigned char* data = cairo_image_surface_get_data(ctx->offscreen_surface);
+        int stride = cairo_image_surface_get_stride(ctx->offscreen_surface);
+        for (int i = 0; i < count; i++)
         {
-            cairo_surface_destroy(offscreen_surface);
-            offscreen_surface = nullptr;
+            int top = ctx->height * i / count;
+            int bottom = ctx->height * (i + 1) / count;
+            cairo_surface_t* surface = cairo_image_surface_create_for_data(
+                data + static_cast<size_t>(top) * stride, CAIRO_FORMAT_ARGB32, ctx->width, bottom - top, stride);
+            // Commands keep overlay coordinates; the offset keeps the CTM, and so glyph caching, untouched
+            cairo_surface_set_device_offset(surface, 0, -top);
+            ctx->tile_surfaces.push_back(surface);
+            ctx->tile_crs.push_back(cairo_create(surface));
+            ctx->tile_tops.push_back(top);
         }
+    }
 
-        if (overlay_window)
+    // PangoLayout is not thread safe, so the glyphs are positioned here and the
+    // workers only see fonts and coordinates. Unknown-glyph hex boxes are dropped.
+    void appendGlyphRuns(PangoLayout* layout, int x, int y)
+    {
+        PangoLayoutIter* iter = pango_layout_get_iter(layout);
+        do
         {
-            XDestroyWindow(display, overlay_window);
-            overlay_window = 0;
-        }
+            PangoLayoutRun* run = pango_layout_iter_get_run_readonly(iter);
+            if (!run)
+                continue; // End of a line
+
+            cairo_scaled_font_t* font =
+                pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(run->item->analysis.font));
+            if (!font)
+                continue;
+
+            PangoRectangle logical;
+            pango_layout_iter_get_run_extents(iter, nullptr, &logical);
+            double baseline = y + pango_layout_iter_get_baseline(iter) / double(PANGO_SCALE);
+
+            GlyphRun glyph_run;
+            glyph_run.font = cairo_scaled_font_reference(font);
+            glyph_run.first_glyph = ctx->tile_glyphs.size();
+            int pen = logical.x;
+            for (int i = 0; i < run->glyphs->num_glyphs; i++)
+            {
+                const PangoGlyphInfo& info = run->glyphs->glyphs[i];
+                if (info.glyph != PANGO_GLYPH_EMPTY && !(info.glyph & PANGO_GLYPH_UNKNOWN_FLAG))
+                {
+                    cairo_glyph_t glyph;
+                    glyph.index = info.glyph;
+                    glyph.x = x + (pen + info.geometry.x_offset) / double(PANGO_SCALE);
+                    glyph.y = baseline + info.geometry.y_offset / double(PANGO_SCALE);
+                    ctx->tile_glyphs.push_back(glyph);
+                }
+                pen += info.geometry.width;
+            }
+            glyph_run.glyph_count = ctx->tile_glyphs.size() - glyph_run.first_glyph;
+            ctx->tile_runs.push_back(glyph_run);
+        } while (pango_layout_iter_next_run(iter));
+        pango_layout_iter_free(iter);
+    }
 
-        if (colormap)
+    // Pixels a label can touch, relative to the top-left of its text
+    void labelBounds(PangoLayout* layout, const LabelPaint& paint, int text_width, int text_height, int& x0,
+                     int& y0, int& x1, int& y1)
+    {
+        PangoRectangle ink;
+        pango_layout_get_pixel_extents(layout, &ink, nullptr);
+        int grow = static_cast<int>(std::ceil(paint.outline_width)) + 2; // Stroke plus antialiasing
+        x0 = ink.x - grow;
+        y0 = ink.y - grow;
+        x1 = ink.x + ink.width + grow;
+        y1 = ink.y + ink.height + grow;
+        if (paint.style == Draw::STYLE_BACKGROUND)
         {
-            XFreeColormap(display, colormap);
-            colormap = 0;
+            x0 = std::min(x0, -paint.padding);
+            y0 = std::min(y0, -paint.padding);
+            x1 = std::max(x1, text_width + paint.padding);
+            y1 = std::max(y1, text_height + paint.padding);
         }
-
-        target_window = 0;
-        overlay_initialized = false;
-        current_cr = nullptr;
-        
-        std::cout << "Overlay cleaned up" << std::endl;
     }
 
-} // namespace
+    void recordTileCommand(const LabelPaint& paint, PangoLayout* layout, int x, int y, int text_width,
+                           int text_height)
+    {
+        int x0, y0, x1, y1;
+        labelBounds(layout, paint, text_width, text_height, x0, y0, x1, y1);
+
+        TileCommand command;
+        command.paint = paint;
+        command.x = x;
+        command.y = y;
+        command.text_width = text_width;
+        command.text_height = text_height;
+        command.top = y + y0;
+        command.bottom = y + y1;
+        command.first_run = ctx->tile_runs.size();
+        appendGlyphRuns(layout, x, y);
+        command.run_count = ctx->tile_runs.size() - command.first_run;
+        ctx->tile_commands.push_back(command);
+    }
 
-namespace Draw
-{
-    void drawStringPlain(const std::string& text, int x, int y, double r, double g, double b, const char* font_family,
-                         int font_size, TextAlignment alignment)
+    void addGlyphRuns(const OverlayContext& c, cairo_t* tile_cr, const TileCommand& command, bool as_path)
     {
-        if (!current_cr)
-            return;
+        for (size_t i = command.first_run; i < command.first_run + command.run_count; i++)
+        {
+            const GlyphRun& run = c.tile_runs[i];
+            if (!run.glyph_count)
+                continue;
+            cairo_set_scaled_font(tile_cr, run.font);
+            if (as_path)
+                cairo_glyph_path(tile_cr, &c.tile_glyphs[run.first_glyph], static_cast<int>(run.glyph_count));
+            else
+                cairo_show_glyphs(tile_cr, &c.tile_glyphs[run.first_glyph], static_cast<int>(run.glyph_count));
+        }
+    }
 
-        PangoLayout* layout = pango_cairo_create_layout(current_cr);
-        setLayoutFont(layout, font_family, font_size);
-        pango_layout_set_text(layout, text.c_str(), -1);
-        
-        // Set alignment
-        PangoAlignment pango_align = PANGO_ALIGN_LEFT;
-        if (alignment == ALIGN_CENTER)
-            pango_align = PANGO_ALIGN_CENTER;
-        else if (alignment == ALIGN_RIGHT)
-            pango_align = PANGO_ALIGN_RIGHT;
-        
-        pango_layout_set_alignment(layout, pango_align);
+    // Runs on the worker pool: touches only this band and read-only frame data
+    void rasterizeTile(const OverlayContext& c, int index)
+    {
+        cairo_surface_t* surface = c.tile_surfaces[index];
+        cairo_t* tile_cr = c.tile_crs[index];
+        int top = c.tile_tops[index];
+        int bottom = index + 1 < static_cast<int>(c.tile_tops.size()) ? c.tile_tops[index + 1] : c.height;
 
-        // Get text extents to adjust position
-        int text_width, text_height;
-        pango_layout_get_pixel_size(layout, &text_width, &text_height);
-        
-        // Adjust x position based on alignment
-        int draw_x = x;
-        if (alignment == ALIGN_CENTER)
-            draw_x = x - text_width / 2;
-        else if (alignment == ALIGN_RIGHT)
-            draw_x = x - text_width;
+        PixelOps::clear(cairo_image_surface_get_data(surface), cairo_image_surface_get_stride(surface), c.width,
+                        bottom - top);
+        cairo_surface_mark_dirty(surface);
 
-        cairo_set_source_rgba(current_cr, r, g, b, 1.0);
-        cairo_move_to(current_cr, draw_x, y);
-        pango_cairo_show_layout(current_cr, layout);
+        for (const TileCommand& command : c.tile_commands)
+        {
+            if (command.bottom <= top || command.top >= bottom)
+                continue;
 
-        g_object_unref(layout);
+            const LabelPaint& paint = command.paint;
+            if (paint.style == Draw::STYLE_BACKGROUND)
+            {
+                cairo_set_source_rgba(tile_cr, paint.extra_r, paint.extra_g, paint.extra_b, paint.extra_a);
+                cairo_rectangle(tile_cr, command.x - paint.padding, command.y - paint.padding,
+                                command.text_width + 2 * paint.padding, command.text_height + 2 * paint.padding);
+                cairo_fill(tile_cr);
+            }
+            else if (paint.style == Draw::STYLE_OUTLINE)
+            {
+                cairo_set_source_rgba(tile_cr, paint.extra_r, paint.extra_g, paint.extra_b, paint.extra_a);
+                cairo_set_line_width(tile_cr, paint.outline_width * 2);
+                addGlyphRuns(c, tile_cr, command, true);
+                cairo_stroke(tile_cr);
+            }
+            cairo_set_source_rgba(tile_cr, paint.r, paint.g, paint.b, 1.0);
+            addGlyphRuns(c, tile_cr, command, false);
+        }
+        cairo_surface_flush(surface);
     }
 
-    void drawStringOutline(const std::string& text, int x, int y, double r, double g, double b, double outline_r,
-                           double outline_g, double outline_b, double outline_a, double outline_width,
-                           const char* font_family, int font_size, TextAlignment alignment)
+    void rasterizeTiles()
     {
-        if (!current_cr)
-            return;
-
-        PangoLayout* layout = pango_cairo_create_layout(current_cr);
-        setLayoutFont(layout, font_family, font_size);
-        pango_layout_set_text(layout, text.c_str(), -1);
-        
-        // Set alignment
-        PangoAlignment pango_align = PANGO_ALIGN_LEFT;
-        if (alignment == ALIGN_CENTER)
-            pango_align = PANGO_ALIGN_CENTER;
-        else if (alignment == ALIGN_RIGHT)
-            pango_align = PANGO_ALIGN_RIGHT;
-        
-        pango_layout_set_alignment(layout, pango_align);
+        FrameStats::ScopedPhase phase(Overlay::METRIC_RASTER);
+        const OverlayContext& c = *ctx;
+        WorkerPool::run(static_cast<int>(c.tile_crs.size()), [&c](int index) { rasterizeTile(c, index); });
+        cairo_surface_mark_dirty(ctx->offscreen_surface);
+        clearTileCommands();
+    }
 
-        // Get text extents to adjust position
-        int text_width, text_height;
-        pango_layout_get_pixel_size(layout, &text_width, &text_height);
-        
-        // Adjust x position based on alignment
-        int draw_x = x;
-        if (alignment == ALIGN_CENTER)
-            draw_x = x - text_width / 2;
-        else if (alignment == ALIGN_RIGHT)
-            draw_x = x - text_width;
+    void releaseOffscreenBuffer()
+    {
+        releaseTiles();
+        if (ctx->cr)
+        {
+            cairo_destroy(ctx->cr);
+            ctx->cr = nullptr;
+        }
+        if (ctx->window_cr)
+        {
+            // Drop the presentation context's reference to the old buffer
+            cairo_set_source_rgba(ctx->window_cr, 0, 0, 0, 0);
+        }
+        if (ctx->offscreen_surface)
+        {
+            cairo_surface_destroy(ctx->offscreen_surface);
+            ctx->offscreen_surface = nullptr;
+        }
+        if (ctx->shm_active)
+        {
+            drainShmCompletion();
+            XShmDetach(display, &ctx->shm_info);
+            ctx->shm_image->data = nullptr; // Not malloc'd, XDestroyImage must not free it
+            XDestroyImage(ctx->shm_image);
+            ctx->shm_image = nullptr;
+            shmdt(ctx->shm_info.shmaddr);
+            ctx->shm_active = false;
+        }
+    }
 
-        cairo_save(current_cr);
-        cairo_set_source_rgba(current_cr, outline_r, outline_g, outline_b, outline_a);
-        cairo_set_line_width(current_cr, outline_width * 2);
-        cairo_move_to(current_cr, draw_x, y);
-        pango_cairo_layout_path(current_cr, layout);
-        cairo_stroke(current_cr);
-        cairo_restore(current_cr);
+    void ensureOffscreenBuffer()
+    {
+        bool want_shm = shm_enabled && !shm_unavailable && !ctx->headless;
+        if (!ctx->offscreen_surface || ctx->buffer_width != ctx->width || ctx->buffer_height != ctx->height ||
+            ctx->shm_active != want_shm)
+        {
+            releaseOffscreenBuffer();
+            if (!want_shm || !createShmBuffer())
+                ctx->offscreen_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, ctx->width, ctx->height);
 
-        cairo_set_source_rgba(current_cr, r, g, b, 1.0);
-        cairo_move_to(current_cr, draw_x, y);
-        pango_cairo_show_layout(current_cr, layout);
+            ctx->cr = cairo_create(ctx->offscreen_surface);
+            if (!pango_context)
+                pango_context = pango_cairo_create_context(ctx->cr);
+            else
+                pango_cairo_update_context(ctx->cr, pango_context);
+            if (ctx->window_cr)
+                cairo_set_source_surface(ctx->window_cr, ctx->offscreen_surface, 0, 0);
 
-        g_object_unref(layout);
+            ctx->buffer_width = ctx->width;
+            ctx->buffer_height = ctx->height;
+        }
     }
 
-    void drawStringBackground(const std::string& text, int x, int y, double r, double g, double b, double bg_r,
-                              double bg_g, double bg_b, double bg_a, int padding, const char* font_family,
-                              int font_size, TextAlignment alignment)
+    bool checkTargetWindowExists()
     {
-        if (!current_cr)
-            return;
+        if (!display || !ctx->target_window)
+            return false;
 
-        PangoLayout* layout = pango_cairo_create_layout(current_cr);
-        setLayoutFont(layout, font_family, font_size);
-        pango_layout_set_text(layout, text.c_str(), -1);
+        // Reset error flag
+        x_error_occurred = false;
         
-        // Set alignment
-        PangoAlignment pango_align = PANGO_ALIGN_LEFT;
-        if (alignment == ALIGN_CENTER)
-            pango_align = PANGO_ALIGN_CENTER;
-        else if (alignment == ALIGN_RIGHT)
-            pango_align = PANGO_ALIGN_RIGHT;
+        // Check if the target window still exists
+        XWindowAttributes attr;
+        FrameStats::countRoundTrip();
+        if (!XGetWindowAttributes(display, ctx->target_window, &attr))
+        {
+            // If we get here and x_error_occurred is true, it means we got a BadWindow error
+            return false;
+        }
         
-        pango_layout_set_alignment(layout, pango_align);
-
-        // Get text extents to adjust position
-        int text_width, text_height;
-        pango_layout_get_pixel_size(layout, &text_width, &text_height);
+        // Check if an X error occurred
+        if (x_error_occurred) {
+            return false;
+        }
         
-        // Adjust x position based on alignment
-        int draw_x = x;
-        if (alignment == ALIGN_CENTER)
-            draw_x = x - text_width / 2;
-        else if (alignment == ALIGN_RIGHT)
-            draw_x = x - text_width;
-
-        // Adjust background position based on alignment
-        int bg_x = draw_x - padding;
-        int bg_y = y - padding;
-        int bg_width = text_width + 2 * padding;
-        int bg_height = text_height + 2 * padding;
-
-        cairo_set_source_rgba(current_cr, bg_r, bg_g, bg_b, bg_a);
-        cairo_rectangle(current_cr, bg_x, bg_y, bg_width, bg_height);
-        cairo_fill(current_cr);
-
-        cairo_set_source_rgba(current_cr, r, g, b, 1.0);
-        cairo_move_to(current_cr, draw_x, y);
-        pango_cairo_show_layout(current_cr, layout);
+        return true;
+    }
 
-        g_object_unref(layout);
+    bool isTrackedWindow(const OverlayContext& c, Window w)
+    {
+        return std::find(c.tracked_windows.begin(), c.tracked_windows.end(), w) != c.tracked_windows.end();
     }
 
-    void getTextSize(const std::string& text, int* width, int* height, const char* font_family, int font_size)
+    bool trackedByOtherContext(Window w)
     {
-        if (!current_cr)
-            return;
+        for (auto& entry : contexts)
+        {
+            if (&entry.second != ctx && isTrackedWindow(entry.second, w))
+                return true;
+        }
+        return false;
+    }
 
-        PangoLayout* layout = pango_cairo_create_layout(current_cr);
-        setLayoutFont(layout, font_family, font_size);
-        pango_layout_set_text(layout, text.c_str(), -1);
+    void unselectTrackedWindows()
+    {
+        for (Window w : ctx->tracked_windows)
+        {
+            // A destroyed target takes its selection with it, its frame and
+            // ancestors may live on. Overlays on sibling targets can share those.
+            if ((ctx->target_destroyed && w == ctx->target_window) || trackedByOtherContext(w))
+                continue;
+            XSelectInput(display, w, NoEventMask);
+        }
+        ctx->tracked_windows.clear();
+    }
 
-        int w, h;
-        pango_layout_get_pixel_size(layout, &w, &h);
+    void selectTrackedWindows()
+    {
+        unselectTrackedWindows();
 
-        if (width)
-            *width = w;
-        if (height)
-            *height = h;
+        // Watch the target and every ancestor up to (not including) root, since a
+        // reparenting window manager moves the frame rather than the client window
+        Window root = DefaultRootWindow(display);
+        Window w = ctx->target_window;
+        while (w && w != root)
+        {
+            XSelectInput(display, w, StructureNotifyMask);
+            ctx->tracked_windows.push_back(w);
+
+            Window root_return, parent_return;
+            Window* children = nullptr;
+            unsigned int nchildren = 0;
+            FrameStats::countRoundTrip();
+            if (!XQueryTree(display, w, &root_return, &parent_return, &children, &nchildren))
+                break;
+            if (children)
+                XFree(children);
+            w = parent_return;
+        }
 
-        g_object_unref(layout);
+        ctx->ancestors_dirty = false;
     }
-} // namespace Draw
 
-namespace Overlay
-{
-    bool isInitialized()
+    bool isOverlayWindow(Window w)
     {
-        return overlay_initialized;
+        for (auto& entry : contexts)
+        {
+            if (entry.second.overlay_window == w)
+                return true;
+        }
+        return false;
     }
 
-    void cleanup()
+    void dispatchEvent(OverlayContext& c, const XEvent& ev)
     {
-        cleanupOverlayInternal();
-    }
+        if (ev.type == shm_completion_event)
+        {
+            if (shmCompletionDrawable(ev) == c.overlay_window)
+                c.shm_busy = false;
+            return;
+        }
 
-    bool tryInitialize(const char* window_class)
-    {
-        if (overlay_initialized)
+        switch (ev.type)
         {
-            // Check if our current target window still exists
-            if (!checkTargetWindowExists())
+        case ConfigureNotify:
+            if (isTrackedWindow(c, ev.xconfigure.window))
+                c.geometry_dirty = true;
+            break;
+        case ReparentNotify:
+            if (isTrackedWindow(c, ev.xreparent.window))
             {
-                std::cout << "Target window lost, cleaning up overlay..." << std::endl;
-                cleanupOverlayInternal();
+                c.ancestors_dirty = true;
+                c.geometry_dirty = true;
             }
-            else
+            break;
+        case DestroyNotify:
+            if (ev.xdestroywindow.window == c.target_window)
             {
-                return true; // Already initialized and window exists
+                c.target_destroyed = true;
             }
+            else if (isTrackedWindow(c, ev.xdestroywindow.window))
+            {
+                // Gone, so never unselected
+                c.tracked_windows.erase(
+                    std::remove(c.tracked_windows.begin(), c.tracked_windows.end(), ev.xdestroywindow.window),
+                    c.tracked_windows.end());
+                c.ancestors_dirty = true;
+            }
+            break;
+        case PropertyNotify:
+            if (ev.xproperty.window == DefaultRootWindow(display) && ev.xproperty.atom == net_client_list)
+                c.discovery_dirty = true;
+            break;
+        case MapNotify:
+            // Only contexts still looking for their target collect candidates
+            if (discovery_watching && !c.overlay_initialized && !c.fixed_window &&
+                ev.xmap.event == DefaultRootWindow(display) && !isOverlayWindow(ev.xmap.window))
+                c.discovery_candidates.push_back(ev.xmap.window);
+            break;
+        case Expose:
+            if (ev.xexpose.window == c.overlay_window)
+                Overlay::markDirty();
+            break;
+        default:
+            break;
         }
+    }
 
-        // Try to initialize with the new window class
-        if (window_class)
-        {
-            current_window_class = window_class;
-        }
-
-        if (!current_window_class.empty())
+    void processPendingEvents()
+    {
+        // XPending only reads what the server already sent, it never waits for a reply.
+        // Whichever context drains the queue, every context sees every event.
+        while (XPending(display))
         {
-            return initializeOverlayInternal(current_window_class.c_str());
+            XEvent ev;
+            XNextEvent(display, &ev);
+            for (auto& entry : contexts)
+                dispatchEvent(entry.second, ev);
         }
-
-        return false;
     }
 
-    bool initialize(const char* window_class)
+    bool windowHasClass(Window w, const std::string& target_class)
     {
-        current_window_class = window_class ? window_class : "";
-        return tryInitialize(window_class);
+        XClassHint classHint;
+        if (!XGetClassHint(display, w, &classHint))
+            return false;
+
+        bool match = classHint.res_class && target_class == classHint.res_class;
+        if (classHint.res_name)
+            XFree(classHint.res_name);
+        if (classHint.res_class)
+            XFree(classHint.res_class);
+        return match;
     }
 
-    void shutdown()
+    bool readClientList(std::vector<Window>& clients)
     {
-        cleanupOverlayInternal();
-        if (display)
+        Atom type;
+        int format;
+        unsigned long count, bytes_after;
+        unsigned char* data = nullptr;
+        if (XGetWindowProperty(display, DefaultRootWindow(display), net_client_list, 0, 65536, False, XA_WINDOW,
+                               &type, &format, &count, &bytes_after, &data) != Success)
+            return false;
+
+        bool ok = type == XA_WINDOW && format == 32;
+        if (ok)
         {
-            XCloseDisplay(display);
-            display = nullptr;
+            Window* windows = reinterpret_cast<Window*>(data);
+            clients.assign(windows, windows + count);
         }
+        if (data)
+            XFree(data);
+        return ok;
     }
 
-    void beginFrame()
+    void startDiscoveryWatch()
     {
-        if (!overlay_initialized)
+        if (discovery_watching)
             return;
 
-        ensureOffscreenBuffer();
-        cr = cairo_create(offscreen_surface);
-        current_cr = cr;
-
-        // Clear with transparent background
-        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-        cairo_set_source_rgba(cr, 0, 0, 0, 0);
-        cairo_paint(cr);
-        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        XSelectInput(display, DefaultRootWindow(display), PropertyChangeMask | SubstructureNotifyMask);
+        net_client_list = XInternAtom(display, "_NET_CLIENT_LIST", False);
+        discovery_watching = true;
+        for (auto& entry : contexts)
+        {
+            entry.second.discovery_dirty = true;
+            // Without a client list, windows mapped while we were not watching
+            // can only be found by walking the tree again
+            if (!have_client_list)
+                entry.second.discovery_walked = false;
+        }
     }
 
-    void endFrame()
+    void stopDiscoveryWatch()
     {
-        if (!cr || !overlay_initialized)
+        ctx->discovery_candidates.clear();
+        if (!discovery_watching)
             return;
 
-        cairo_destroy(cr);
-        cr = nullptr;
-        current_cr = nullptr;
+        // The root selection is shared, keep it while another context is searching
+        for (auto& entry : contexts)
+        {
+            const OverlayContext& c = entry.second;
+            if (&c != ctx && !c.overlay_initialized && !c.fixed_window && !c.current_window_class.empty())
+                return;
+        }
+
+        XSelectInput(display, DefaultRootWindow(display), NoEventMask);
+        discovery_watching = false;
+    }
+
+    bool findTargetWindow(const std::string& target_class, Window& outWin)
+    {
+        if (target_class != ctx->discovery_class)
+        {
+            ctx->discovery_class = target_class;
+            ctx->discovery_checked.clear();
+            ctx->discovery_dirty = true;
+            ctx->discovery_walked = false;
+            ctx->discovery_reported = false;
+        }
+
+        startDiscoveryWatch();
+        processPendingEvents();
+
+        // Newly mapped top-level windows
+        std::vector<Window> candidates;
+        candidates.swap(ctx->discovery_candidates);
+        for (Window w : candidates)
+        {
+            if (windowHasClass(w, target_class))
+            {
+                outWin = w;
+                return true;
+            }
+        }
+
+        // Nothing changed since the last scan, nothing to ask the server
+        if (!ctx->discovery_dirty)
+            return false;
+        ctx->discovery_dirty = false;
+
+        std::vector<Window> clients;
+        have_client_list = readClientList(clients);
+        if (have_client_list)
+        {
+            std::unordered_set<Window> present;
+            for (Window w : clients)
+            {
+                if (!ctx->discovery_checked.count(w) && windowHasClass(w, target_class))
+                {
+                    outWin = w;
+                    return true;
+                }
+                present.insert(w);
+            }
+            ctx->discovery_checked.swap(present); // Forget windows that went away
+        }
+
+        // One full walk per class catches targets outside the client list,
+        // e.g. embedded or override-redirect windows, or no EWMH at all
+        if (!ctx->discovery_walked)
+        {
+            ctx->discovery_walked = true;
+            return findWindowByClass(DefaultRootWindow(display), target_class, outWin);
+        }
+        return false;
+    }
+
+    // Lays out and rasterizes fonts the preload thread has matched: all of
+    // them while no frame has been presented yet, otherwise one per frame,
+    // since a single font can take longer than a frame
+    void warmPreloadedFonts(bool all);
+
+    bool initializeOverlayInternal(const char* window_class)
+    {
+        if (!display)
+        {
+            // Set up X error handler before opening display
+            XSetErrorHandler(xErrorHandler);
+            
+            display = XOpenDisplay(0);
+            if (!display)
+            {
+                std::cerr << "Failed to open X display" << std::endl;
+                return false;
+            }
+            shm_unavailable = false;
+        }
+
+        Window found_window = ctx->fixed_window;
+        if (!found_window && !findTargetWindow(window_class, found_window))
+        {
+            if (!ctx->discovery_reported)
+            {
+                std::cout << "Target window with class '" << window_class << "' not found, waiting for it to appear..."
+                          << std::endl;
+                ctx->discovery_reported = true;
+            }
+            return false;
+        }
+
+        ctx->target_window = found_window;
+        stopDiscoveryWatch();
+        ctx->discovery_reported = false;
+        if (!getWindowGeometry(ctx->target_window)) {
+            std::cerr << "Failed to get window geometry" << std::endl;
+            return false;
+        }
+        createOverlayWindow();
+
+        // Fonts already matched are opened against the overlay's context before its first present
+        ensureOffscreenBuffer();
+        warmPreloadedFonts(true);
+
+        ctx->target_destroyed = false;
+        if (tracking_mode == Overlay::TRACK_EVENTS)
+            selectTrackedWindows();
+        // A move between reading the geometry and selecting its events sent no
+        // ConfigureNotify to us, so read it once more on the next update
+        ctx->geometry_dirty = true;
+
+        ctx->overlay_initialized = true;
+        Overlay::markDirty();
+        if (ctx->fixed_window)
+            std::cout << "Overlay initialized successfully for window 0x" << std::hex << ctx->fixed_window << std::dec
+                      << std::endl;
+        else
+            std::cout << "Overlay initialized successfully for window class: " << window_class << std::endl;
+        return true;
+    }
+
+    void cleanupOverlayInternal()
+    {
+        releaseOffscreenBuffer();
+        if (ctx->window_cr)
+        {
+            cairo_destroy(ctx->window_cr);
+            ctx->window_cr = nullptr;
+        }
+        if (ctx->cairo_surface)
+        {
+            cairo_surface_destroy(ctx->cairo_surface);
+            ctx->cairo_surface = nullptr;
+        }
+        if (ctx->shm_gc)
+        {
+            XFreeGC(display, ctx->shm_gc);
+            ctx->shm_gc = nullptr;
+        }
+
+        if (ctx->overlay_window)
+        {
+            XDestroyWindow(display, ctx->overlay_window);
+            ctx->overlay_window = 0;
+        }
+        unselectTrackedWindows();
+
+        ctx->target_window = 0;
+        ctx->overlay_initialized = false;
+        ctx->headless = false;
+        ctx->current_cr = nullptr;
+        
+        std::cout << "Overlay cleaned up" << std::endl;
+    }
+
+    PangoLayout* createLayout(const std::string& text, const char* font_family, int font_size,
+                              Draw::TextAlignment alignment)
+    {
+        PangoLayout* layout = pango_layout_new(pango_context);
+        setLayoutFont(layout, font_family, font_size);
+        pango_layout_set_text(layout, text.c_str(), -1);
+
+        // Set alignment
+        PangoAlignment pango_align = PANGO_ALIGN_LEFT;
+        if (alignment == Draw::ALIGN_CENTER)
+            pango_align = PANGO_ALIGN_CENTER;
+        else if (alignment == Draw::ALIGN_RIGHT)
+            pango_align = PANGO_ALIGN_RIGHT;
+
+        pango_layout_set_alignment(layout, pango_align);
+        return layout;
+    }
+
+    int alignedX(int x, int text_width, Draw::TextAlignment alignment)
+    {
+        // Adjust x position based on alignment
+        if (alignment == Draw::ALIGN_CENTER)
+            return x - text_width / 2;
+        if (alignment == Draw::ALIGN_RIGHT)
+            return x - text_width;
+        return x;
+    }
+
+    void renderLabel(cairo_t* target, PangoLayout* layout, const LabelPaint& paint, int x, int y, int text_width,
+                     int text_height)
+    {
+        if (paint.style == Draw::STYLE_BACKGROUND)
+        {
+            cairo_set_source_rgba(target, paint.extra_r, paint.extra_g, paint.extra_b, paint.extra_a);
+            cairo_rectangle(target, x - paint.padding, y - paint.padding, text_width + 2 * paint.padding,
+                            text_height + 2 * paint.padding);
+            cairo_fill(target);
+        }
+        else if (paint.style == Draw::STYLE_OUTLINE)
+        {
+            cairo_save(target);
+            cairo_set_source_rgba(target, paint.extra_r, paint.extra_g, paint.extra_b, paint.extra_a);
+            cairo_set_line_width(target, paint.outline_width * 2);
+            cairo_move_to(target, x, y);
+            pango_cairo_layout_path(target, layout);
+            cairo_stroke(target);
+            cairo_restore(target);
+        }
+
+        cairo_set_source_rgba(target, paint.r, paint.g, paint.b, 1.0);
+        cairo_move_to(target, x, y);
+        pango_cairo_show_layout(target, layout);
+    }
+
+    std::string labelKey(const std::string& layout_key, const LabelPaint& paint)
+    {
+        const double values[] = {static_cast<double>(paint.style), paint.r, paint.g, paint.b, paint.extra_r,
+                                 paint.extra_g, paint.extra_b, paint.extra_a, paint.outline_width,
+                                 static_cast<double>(paint.padding)};
+        std::string key(reinterpret_cast<const char*>(values), sizeof(values));
+        key += layout_key;
+        return key;
+    }
+
+    void evictLabels(unsigned long budget)
+    {
+        // The front entry is the one being drawn and stays, whatever its size
+        while (label_cache_bytes > budget && label_cache.size() > 1)
+        {
+            LabelTexture& victim = label_cache.back();
+            if (victim.surface)
+                cairo_surface_destroy(victim.surface);
+            label_cache_bytes -= victim.bytes;
+            label_cache_index.erase(victim.key);
+            label_cache.pop_back();
+            label_cache_evictions++;
+        }
+    }
+
+    void clearLabelCache()
+    {
+        for (auto& entry : label_cache)
+            if (entry.surface)
+                cairo_surface_destroy(entry.surface);
+        label_cache.clear();
+        label_cache_index.clear();
+        label_cache_bytes = 0;
+        label_seen.clear();
+        label_seen_index.clear();
+    }
+
+    // True for the second sighting of a key; the first one is only recorded
+    bool labelSeenBefore(const std::string& key)
+    {
+        size_t hash = std::hash<std::string>()(key);
+        auto it = label_seen_index.find(hash);
+        if (it != label_seen_index.end())
+        {
+            label_seen.erase(it->second);
+            label_seen_index.erase(it);
+            return true;
+        }
+
+        label_seen.push_front(hash);
+        label_seen_index[hash] = label_seen.begin();
+        if (label_seen.size() > LABEL_SEEN_CAPACITY)
+        {
+            label_seen_index.erase(label_seen.back());
+            label_seen.pop_back();
+        }
+        return false;
+    }
+
+    bool createLabelTexture(LabelTexture& texture, PangoLayout* layout, const LabelPaint& paint, int text_width,
+                            int text_height)
+    {
+        int x0, y0, x1, y1;
+        labelBounds(layout, paint, text_width, text_height, x0, y0, x1, y1);
+        cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, x1 - x0, y1 - y0);
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        {
+            cairo_surface_destroy(surface);
+            return false;
+        }
+
+        cairo_t* label_cr = cairo_create(surface);
+        renderLabel(label_cr, layout, paint, -x0, -y0, text_width, text_height);
+        cairo_destroy(label_cr);
+        cairo_surface_flush(surface);
+
+        unsigned long pixel_bytes = static_cast<unsigned long>(cairo_image_surface_get_stride(surface)) * (y1 - y0);
+        texture.surface = surface;
+        texture.origin_x = x0;
+        texture.origin_y = y0;
+        texture.bytes += pixel_bytes;
+        label_cache_bytes += pixel_bytes;
+        return true;
+    }
+
+    // Composites straight into the offscreen buffer, clipped to it
+    void blitLabel(const LabelTexture& texture, int x, int y)
+    {
+        int width = cairo_image_surface_get_width(texture.surface);
+        int height = cairo_image_surface_get_height(texture.surface);
+        int dst_x = x + texture.origin_x;
+        int dst_y = y + texture.origin_y;
+        int x0 = std::max(dst_x, 0);
+        int y0 = std::max(dst_y, 0);
+        int x1 = std::min(dst_x + width, ctx->buffer_width);
+        int y1 = std::min(dst_y + height, ctx->buffer_height);
+        if (x1 <= x0 || y1 <= y0)
+            return;
+
+        int stride = cairo_image_surface_get_stride(ctx->offscreen_surface);
+        int src_stride = cairo_image_surface_get_stride(texture.surface);
+        unsigned char* dst = cairo_image_surface_get_data(ctx->offscreen_surface) +
+                             static_cast<size_t>(y0) * stride + x0 * 4;
+        const unsigned char* src = cairo_image_surface_get_data(texture.surface) +
+                                   static_cast<size_t>(y0 - dst_y) * src_stride + (x0 - dst_x) * 4;
+
+        cairo_surface_flush(ctx->offscreen_surface);
+        PixelOps::over(dst, stride, src, src_stride, x1 - x0, y1 - y0);
+        cairo_surface_mark_dirty_rectangle(ctx->offscreen_surface, x0, y0, x1 - x0, y1 - y0);
+    }
+
+    // Blits the label's texture with PixelOps::over, false if it has none
+    bool drawCachedLabel(const std::string& layout_key, PangoLayout* layout, const LabelPaint& paint, int x, int y,
+                         int text_width, int text_height)
+    {
+        if (!label_cache_budget)
+            return false;
+
+        std::string key = labelKey(layout_key, paint);
+        auto it = label_cache_index.find(key);
+        if (it == label_cache_index.end())
+        {
+            if (!labelSeenBefore(key))
+            {
+                label_cache_misses++;
+                return false;
+            }
+
+            LabelTexture texture;
+            texture.key = key;
+            texture.bytes = key.size();
+            label_cache_bytes += texture.bytes;
+            label_cache.push_front(texture);
+            label_cache_index[key] = label_cache.begin();
+        }
+        else
+        {
+            label_cache.splice(label_cache.begin(), label_cache, it->second);
+        }
+
+        LabelTexture& texture = label_cache.front();
+        if (texture.surface)
+        {
+            label_cache_hits++;
+        }
+        else
+        {
+            label_cache_misses++;
+            if (!createLabelTexture(texture, layout, paint, text_width, text_height))
+                return false;
+            evictLabels(label_cache_budget);
+        }
+        blitLabel(texture, x, y);
+        return true;
+    }
+
+    void paintLabel(const std::string& layout_key, PangoLayout* layout, const LabelPaint& paint, int x, int y,
+                    int text_width, int text_height)
+    {
+        if (ctx->tiled_frame)
+            recordTileCommand(paint, layout, x, y, text_width, text_height);
+        else if (!drawCachedLabel(layout_key, layout, paint, x, y, text_width, text_height))
+            renderLabel(ctx->current_cr, layout, paint, x, y, text_width, text_height);
+    }
+
+    void paintLayoutPlain(const std::string& layout_key, PangoLayout* layout, int text_width, int text_height, int x,
+                          int y, double r, double g, double b, Draw::TextAlignment alignment)
+    {
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_PLAIN);
+        LabelPaint paint;
+        paint.r = r;
+        paint.g = g;
+        paint.b = b;
+        paintLabel(layout_key, layout, paint, alignedX(x, text_width, alignment), y, text_width, text_height);
+    }
+
+    void paintLayoutOutline(const std::string& layout_key, PangoLayout* layout, int text_width, int text_height,
+                            int x, int y, double r, double g, double b, double outline_r, double outline_g,
+                            double outline_b, double outline_a, double outline_width, Draw::TextAlignment alignment)
+    {
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_OUTLINE);
+        LabelPaint paint;
+        paint.style = Draw::STYLE_OUTLINE;
+        paint.r = r;
+        paint.g = g;
+        paint.b = b;
+        paint.extra_r = outline_r;
+        paint.extra_g = outline_g;
+        paint.extra_b = outline_b;
+        paint.extra_a = outline_a;
+        paint.outline_width = outline_width;
+        paintLabel(layout_key, layout, paint, alignedX(x, text_width, alignment), y, text_width, text_height);
+    }
+
+    void paintLayoutBackground(const std::string& layout_key, PangoLayout* layout, int text_width, int text_height,
+                               int x, int y, double r, double g, double b, double bg_r, double bg_g, double bg_b,
+                               double bg_a, int padding, Draw::TextAlignment alignment)
+    {
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_BACKGROUND);
+        LabelPaint paint;
+        paint.style = Draw::STYLE_BACKGROUND;
+        paint.r = r;
+        paint.g = g;
+        paint.b = b;
+        paint.extra_r = bg_r;
+        paint.extra_g = bg_g;
+        paint.extra_b = bg_b;
+        paint.extra_a = bg_a;
+        paint.padding = padding;
+        paintLabel(layout_key, layout, paint, alignedX(x, text_width, alignment), y, text_width, text_height);
+    }
+
+    std::string layoutCacheKey(const std::string& text, const char* font_family, int font_size,
+                               Draw::TextAlignment alignment)
+    {
+        // Resolve defaults so that nullptr and the explicit default share an entry
+        std::string key = font_family ? font_family : "Consolas";
+        key += '\x1f';
+        key += std::to_string(font_size > 0 ? font_size : 20);
+        key += '\x1f';
+        key += static_cast<char>('0' + alignment);
+        key += '\x1f';
+        key += text;
+        return key;
+    }
+
+    void evictLayouts(unsigned long capacity)
+    {
+        while (layout_cache.size() > capacity)
+        {
+            LayoutCacheEntry& victim = layout_cache.back();
+            g_object_unref(victim.layout);
+            layout_cache_index.erase(victim.key);
+            layout_cache.pop_back();
+            layout_cache_evictions++;
+        }
+    }
+
+    void clearLayoutCache()
+    {
+        for (auto& entry : layout_cache)
+            g_object_unref(entry.layout);
+        layout_cache.clear();
+        layout_cache_index.clear();
+    }
+
+    const LayoutCacheEntry* findCachedLayout(const std::string& key)
+    {
+        auto it = layout_cache_index.find(key);
+        if (it == layout_cache_index.end())
+            return nullptr;
+
+        layout_cache.splice(layout_cache.begin(), layout_cache, it->second);
+        layout_cache_hits++;
+        return &*it->second;
+    }
+
+    const LayoutCacheEntry& acquireLayout(const std::string& text, const char* font_family, int font_size,
+                                          Draw::TextAlignment alignment)
+    {
+        std::string key = layoutCacheKey(text, font_family, font_size, alignment);
+        if (const LayoutCacheEntry* cached = findCachedLayout(key))
+            return *cached;
+
+        FrameStats::ScopedPhase phase(Overlay::METRIC_TEXT_LAYOUT);
+        layout_cache_misses++;
+
+        LayoutCacheEntry entry;
+        entry.key = key;
+        entry.layout = createLayout(text, font_family, font_size, alignment);
+        pango_layout_get_pixel_size(entry.layout, &entry.width, &entry.height);
+
+        layout_cache.push_front(entry);
+        layout_cache_index[key] = layout_cache.begin();
 
-        // Blit offscreen buffer to window
-        cairo_t* window_cr = cairo_create(cairo_surface);
-        cairo_set_operator(window_cr, CAIRO_OPERATOR_SOURCE);
-        cairo_set_source_surface(window_cr, offscreen_surface, 0, 0);
-        cairo_paint(window_cr);
-        cairo_destroy(window_cr);
+        // The entry just added is at the front and never evicted here
+        evictLayouts(std::max(layout_cache_capacity, 1ul));
+        return layout_cache.front();
+    }
+
+    void warmPreloadedFonts(bool all)
+    {
+        FontPreload::Job job;
+        while (FontPreload::takeResolved(job))
+        {
+            // Pango does its own matching, the worker's match only warmed fontconfig
+            if (job.match)
+                FcPatternDestroy(job.match);
+
+            const std::string& text = job.characters.empty() ? std::string(" ") : job.characters;
+            const LayoutCacheEntry& entry = acquireLayout(text, job.family.c_str(), job.size, Draw::ALIGN_LEFT);
+            if (ctx->cr && !job.characters.empty() && entry.width > 0 && entry.height > 0)
+            {
+                // Drawing once through the overlay's own context caches the glyphs
+                // with the font options frames use; the group leaves the pixels alone
+                cairo_save(ctx->cr);
+                cairo_rectangle(ctx->cr, 0, 0, entry.width, entry.height);
+                cairo_clip(ctx->cr);
+                cairo_push_group(ctx->cr);
+                cairo_move_to(ctx->cr, 0, 0);
+                pango_cairo_show_layout(ctx->cr, entry.layout);
+                cairo_pattern_destroy(cairo_pop_group(ctx->cr));
+                cairo_restore(ctx->cr);
+            }
+            FontPreload::markReady();
+            if (!all)
+                break;
+        }
+    }
+
+    SceneElement* findElement(Draw::ElementHandle handle)
+    {
+        auto it = scene_elements.find(handle);
+        return it != scene_elements.end() ? &it->second : nullptr;
+    }
+
+    void releaseElementLayout(SceneElement& se)
+    {
+        if (se.layout)
+        {
+            g_object_unref(se.layout);
+            se.layout = nullptr;
+        }
+    }
+
+    bool ensureElementLayout(SceneElement& se)
+    {
+        if (se.layout)
+            return true;
+        // Like getTextSize, this needs no open frame, only the shared Pango context
+        if (!pango_context)
+            return false;
+
+        FrameStats::ScopedPhase phase(Overlay::METRIC_TEXT_LAYOUT);
+        const Draw::TextElement& e = se.element;
+        const char* family = e.font_family.empty() ? nullptr : e.font_family.c_str();
+        se.layout = createLayout(e.text, family, e.font_size, e.alignment);
+        se.layout_key = layoutCacheKey(e.text, family, e.font_size, e.alignment);
+        pango_layout_get_pixel_size(se.layout, &se.text_width, &se.text_height);
+        return true;
+    }
+
+} // namespace
+
+namespace Draw
+{
+    void drawStringPlain(const std::string& text, int x, int y, double r, double g, double b, const char* font_family,
+                         int font_size, TextAlignment alignment)
+    {
+        if (RenderQueue::queuePlain(text, x, y, r, g, b, font_family, font_size, alignment))
+            return;
+
+        if (!ctx->current_cr)
+            return;
+
+        const LayoutCacheEntry& entry = acquireLayout(text, font_family, font_size, alignment);
+        paintLayoutPlain(entry.key, entry.layout, entry.width, entry.height, x, y, r, g, b, alignment);
+    }
+
+    void drawStringOutline(const std::string& text, int x, int y, double r, double g, double b, double outline_r,
+                           double outline_g, double outline_b, double outline_a, double outline_width,
+                           const char* font_family, int font_size, TextAlignment alignment)
+    {
+        if (RenderQueue::queueOutline(text, x, y, r, g, b, outline_r, outline_g, outline_b, outline_a, outline_width,
+                                      font_family, font_size, alignment))
+            return;
+
+        if (!ctx->current_cr)
+            return;
 
-        cairo_surface_flush(cairo_surface);
-        XFlush(display);
+        const LayoutCacheEntry& entry = acquireLayout(text, font_family, font_size, alignment);
+        paintLayoutOutline(entry.key, entry.layout, entry.width, entry.height, x, y, r, g, b, outline_r, outline_g,
+                           outline_b, outline_a, outline_width, alignment);
+    }
+
+    void drawStringBackground(const std::string& text, int x, int y, double r, double g, double b, double bg_r,
+                              double bg_g, double bg_b, double bg_a, int padding, const char* font_family,
+                              int font_size, TextAlignment alignment)
+    {
+        if (RenderQueue::queueBackground(text, x, y, r, g, b, bg_r, bg_g, bg_b, bg_a, padding, font_family, font_size,
+                                         alignment))
+            return;
+
+        if (!ctx->current_cr)
+            return;
+
+        const LayoutCacheEntry& entry = acquireLayout(text, font_family, font_size, alignment);
+        paintLayoutBackground(entry.key, entry.layout, entry.width, entry.height, x, y, r, g, b, bg_r, bg_g, bg_b, bg_a,
+                              padding, alignment);
+    }
+
+    void getTextSize(const std::string& text, int* width, int* height, const char* font_family, int font_size)
+    {
+        // Layouts only need the shared Pango context, which outlives frames
+        if (!pango_context)
+            return;
+
+        // Size does not depend on alignment, so any shaped variant will do
+        const LayoutCacheEntry* entry = nullptr;
+        const TextAlignment alignments[] = {ALIGN_LEFT, ALIGN_CENTER, ALIGN_RIGHT};
+        for (TextAlignment alignment : alignments)
+        {
+            entry = findCachedLayout(layoutCacheKey(text, font_family, font_size, alignment));
+            if (entry)
+                break;
+        }
+        if (!entry)
+            entry = &acquireLayout(text, font_family, font_size, ALIGN_LEFT);
+
+        if (width)
+            *width = entry->width;
+        if (height)
+            *height = entry->height;
+    }
+
+    ElementHandle createTextElement(const TextElement& element)
+    {
+        ElementHandle handle = next_element_handle++;
+        scene_elements[handle].element = element;
+        Overlay::markDirty();
+        return handle;
+    }
+
+    void destroyTextElement(ElementHandle handle)
+    {
+        auto it = scene_elements.find(handle);
+        if (it == scene_elements.end())
+            return;
+        releaseElementLayout(it->second);
+        scene_elements.erase(it);
+        Overlay::markDirty();
+    }
+
+    void setElementText(ElementHandle handle, const std::string& text)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || se->element.text == text)
+            return;
+        se->element.text = text;
+        releaseElementLayout(*se);
+        Overlay::markDirty();
+    }
+
+    void setElementPosition(ElementHandle handle, int x, int y)
+    {
+        // Position and colour are applied at paint time, the layout stays valid
+        SceneElement* se = findElement(handle);
+        if (!se || (se->element.x == x && se->element.y == y))
+            return;
+        se->element.x = x;
+        se->element.y = y;
+        Overlay::markDirty();
+    }
+
+    void setElementColor(ElementHandle handle, double r, double g, double b)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || (se->element.r == r && se->element.g == g && se->element.b == b))
+            return;
+        se->element.r = r;
+        se->element.g = g;
+        se->element.b = b;
+        Overlay::markDirty();
+    }
+
+    void setElementVisible(ElementHandle handle, bool visible)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || se->element.visible == visible)
+            return;
+        se->element.visible = visible;
+        Overlay::markDirty();
+    }
+
+    void getElementSize(ElementHandle handle, int* width, int* height)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || !ensureElementLayout(*se))
+            return;
+        if (width)
+            *width = se->text_width;
+        if (height)
+            *height = se->text_height;
+    }
+
+    void drawElements()
+    {
+        if (!ctx->current_cr)
+            return;
+
+        for (auto& entry : scene_elements)
+        {
+            SceneElement& se = entry.second;
+            const TextElement& e = se.element;
+            if (!e.visible || !ensureElementLayout(se))
+                continue;
+
+            if (e.style == STYLE_OUTLINE)
+                paintLayoutOutline(se.layout_key, se.layout, se.text_width, se.text_height, e.x, e.y, e.r, e.g, e.b,
+                                   e.outline_r, e.outline_g, e.outline_b, e.outline_a, e.outline_width, e.alignment);
+            else if (e.style == STYLE_BACKGROUND)
+                paintLayoutBackground(se.layout_key, se.layout, se.text_width, se.text_height, e.x, e.y, e.r, e.g,
+                                      e.b, e.bg_r, e.bg_g, e.bg_b, e.bg_a, e.padding, e.alignment);
+            else
+                paintLayoutPlain(se.layout_key, se.layout, se.text_width, se.text_height, e.x, e.y, e.r, e.g, e.b,
+                                 e.alignment);
+        }
+    }
+} // namespace Draw
+
+namespace Overlay
+{
+    bool isInitialized()
+    {
+        return ctx->overlay_initialized;
+    }
+
+    void cleanup()
+    {
+        cleanupOverlayInternal();
+    }
+
+    bool tryInitialize(const char* window_class)
+    {
+        if (ctx->headless)
+            return ctx->overlay_initialized;
+
+        if (ctx->overlay_initialized)
+        {
+            // Check if our current target window still exists
+            bool target_alive;
+            if (tracking_mode == TRACK_EVENTS)
+            {
+                processPendingEvents();
+                target_alive = !ctx->target_destroyed;
+            }
+            else
+            {
+                target_alive = checkTargetWindowExists();
+            }
+
+            if (!target_alive)
+            {
+                std::cout << "Target window lost, cleaning up overlay..." << std::endl;
+                cleanupOverlayInternal();
+            }
+            else
+            {
+                return true; // Already initialized and window exists
+            }
+        }
+
+        // Try to initialize with the new window class
+        if (window_class)
+        {
+            ctx->current_window_class = window_class;
+        }
+
+        if (ctx->fixed_window || !ctx->current_window_class.empty())
+        {
+            return initializeOverlayInternal(ctx->current_window_class.c_str());
+        }
+
+        return false;
+    }
+
+    bool initialize(const char* window_class)
+    {
+        ctx->current_window_class = window_class ? window_class : "";
+        return tryInitialize(window_class);
+    }
+
+    bool initializeHeadless(int w, int h)
+    {
+        if (ctx->overlay_initialized)
+            cleanupOverlayInternal();
+        if (w <= 0 || h <= 0)
+            return false;
+
+        ctx->pos_x = ctx->pos_y = 0;
+        ctx->width = w;
+        ctx->height = h;
+        ctx->headless = true;
+        ctx->overlay_initialized = true;
+        ensureOffscreenBuffer();
+        Overlay::markDirty();
+        std::cout << "Overlay initialized headless at " << w << "x" << h << std::endl;
+        return true;
+    }
+
+    bool readPixels(std::vector<unsigned int>& pixels, int* w, int* h)
+    {
+        if (!ctx->overlay_initialized || !ctx->offscreen_surface)
+            return false;
+
+        cairo_surface_flush(ctx->offscreen_surface);
+        const unsigned char* data = cairo_image_surface_get_data(ctx->offscreen_surface);
+        int stride = cairo_image_surface_get_stride(ctx->offscreen_surface);
+        int sw = cairo_image_surface_get_width(ctx->offscreen_surface);
+        int sh = cairo_image_surface_get_height(ctx->offscreen_surface);
+        if (!data)
+            return false;
+
+        pixels.resize(static_cast<size_t>(sw) * sh);
+        PixelOps::copy(reinterpret_cast<unsigned char*>(pixels.data()), sw * 4, data, stride, sw, sh);
+
+        if (w)
+            *w = sw;
+        if (h)
+            *h = sh;
+        return true;
+    }
+
+    bool writePng(const char* path)
+    {
+        if (!path || !ctx->overlay_initialized || !ctx->offscreen_surface)
+            return false;
+
+        cairo_surface_flush(ctx->offscreen_surface);
+        return cairo_surface_write_to_png(ctx->offscreen_surface, path) == CAIRO_STATUS_SUCCESS;
+    }
+
+    void shutdown()
+    {
+        for (auto& entry : contexts)
+        {
+            ctx = &entry.second;
+            if (ctx->overlay_initialized)
+                cleanupOverlayInternal();
+        }
+        contexts.clear();
+        ctx = &contexts[DEFAULT_CONTEXT];
+
+        if (display)
+        {
+            if (colormap)
+                XFreeColormap(display, colormap);
+            XCloseDisplay(display);
+            display = nullptr;
+        }
+        colormap = 0;
+        visual = nullptr;
+
+        for (auto& entry : scene_elements)
+            releaseElementLayout(entry.second);
+        scene_elements.clear();
+        clearLayoutCache();
+        clearLabelCache();
+        FontPreload::shutdown();
+        WorkerPool::shutdown();
+        discovery_watching = false;
+        if (pango_context)
+        {
+            g_object_unref(pango_context);
+            pango_context = nullptr;
+        }
+    }
+
+    void beginFrame()
+    {
+        if (!ctx->overlay_initialized)
+            return;
+
+        if (!batching)
+            FrameStats::beginFrame();
+        ensureOffscreenBuffer();
+        warmPreloadedFonts(false); // Fonts that resolved after initialization
+        {
+            // The server may still be reading last frame out of the segment
+            FrameStats::ScopedPhase phase(METRIC_PRESENT);
+            waitForShmCompletion();
+        }
+        ctx->current_cr = ctx->cr;
+
+        // Reset whatever state the previous frame left behind
+        cairo_identity_matrix(ctx->cr);
+        cairo_reset_clip(ctx->cr);
+        cairo_new_path(ctx->cr);
+
+        // Each band clears itself when it is rasterized
+        ctx->tiled_frame = raster_threads > 1;
+        if (ctx->tiled_frame)
+        {
+            ensureTiles();
+            clearTileCommands();
+            return;
+        }
+
+        // Clear with transparent background, straight into the pixels
+        FrameStats::ScopedPhase phase(METRIC_CLEAR);
+        cairo_surface_flush(ctx->offscreen_surface);
+        PixelOps::clear(cairo_image_surface_get_data(ctx->offscreen_surface),
+                        cairo_image_surface_get_stride(ctx->offscreen_surface), ctx->width, ctx->height);
+        cairo_surface_mark_dirty(ctx->offscreen_surface);
+    }
+
+    void endFrame()
+    {
+        if (!ctx->current_cr || !ctx->overlay_initialized)
+            return;
+
+        ctx->current_cr = nullptr;
+        if (ctx->tiled_frame)
+        {
+            rasterizeTiles();
+            ctx->tiled_frame = false;
+        }
+
+        if (!ctx->headless)
+        {
+            FrameStats::ScopedPhase phase(METRIC_PRESENT);
+            if (ctx->shm_active)
+            {
+                cairo_surface_flush(ctx->offscreen_surface);
+                XShmPutImage(display, ctx->overlay_window, ctx->shm_gc, ctx->shm_image, 0, 0, 0, 0, ctx->width,
+                             ctx->height, True);
+                ctx->shm_busy = true;
+            }
+            else
+            {
+                // Blit offscreen buffer to window, source was set when the buffer was created
+                cairo_surface_flush(ctx->offscreen_surface);
+                cairo_paint(ctx->window_cr);
+
+                cairo_surface_flush(ctx->cairo_surface);
+            }
+            if (!batching)
+                XFlush(display);
+        }
+
+        // The Cairo backend always presents the whole frame
+        ctx->damage_stats.frame_pixels = (long long)ctx->width * ctx->height;
+        ctx->damage_stats.damaged_pixels = ctx->damage_stats.frame_pixels;
+        ctx->damage_stats.damage_rects = 1;
+        if (!batching)
+            FrameStats::endFrame(display ? NextRequest(display) : 0);
     }
 
     void updateWindowPosition()
     {
-        if (!overlay_initialized || !target_window)
+        if (!ctx->overlay_initialized || !ctx->target_window)
             return;
 
-        // Check if target window still exists
-        if (!checkTargetWindowExists())
+        FrameStats::ScopedPhase phase(METRIC_GEOMETRY);
+        // Polling still gets Expose and discovery events, only geometry is asked for
+        processPendingEvents();
+        if (tracking_mode == TRACK_EVENTS)
+        {
+            if (ctx->target_destroyed)
+            {
+                std::cout << "Target window disappeared during update" << std::endl;
+                cleanupOverlayInternal();
+                return;
+            }
+            if (ctx->ancestors_dirty)
+                selectTrackedWindows();
+            // Steady state: nothing moved, nothing to ask the server
+            if (!ctx->geometry_dirty)
+                return;
+        }
+        else if (!checkTargetWindowExists())
         {
+            // Check if target window still exists
             std::cout << "Target window disappeared during update" << std::endl;
             cleanupOverlayInternal();
             return;
         }
 
+        int last_x = ctx->pos_x, last_y = ctx->pos_y;
+        int last_w = ctx->width, last_h = ctx->height;
+
         // Use the safe version of getWindowGeometry
-        if (!getWindowGeometry(target_window)) {
+        if (!getWindowGeometry(ctx->target_window)) {
             std::cout << "Failed to get window geometry, cleaning up overlay" << std::endl;
             cleanupOverlayInternal();
             return;
         }
+        ctx->geometry_dirty = false;
+
+        if (ctx->pos_x == last_x && ctx->pos_y == last_y && ctx->width == last_w && ctx->height == last_h)
+            return;
+
+        XMoveResizeWindow(display, ctx->overlay_window, ctx->pos_x, ctx->pos_y, ctx->width, ctx->height);
+        markDirty();
+        if (ctx->width != last_w || ctx->height != last_h)
+            cairo_xlib_surface_set_size(ctx->cairo_surface, ctx->width, ctx->height);
+    }
+
+    void setTrackingMode(TrackingMode mode)
+    {
+        if (mode == tracking_mode)
+            return;
+
+        tracking_mode = mode;
+        if (!ctx->overlay_initialized)
+            return;
+
+        if (mode == TRACK_EVENTS)
+        {
+            selectTrackedWindows();
+            ctx->geometry_dirty = true; // Anything may have moved while we weren't listening
+        }
+        else
+        {
+            unselectTrackedWindows();
+        }
+    }
+
+    void setSharedMemoryPresent(bool enabled)
+    {
+        // Takes effect when the next frame sets up its offscreen buffer
+        shm_enabled = enabled;
+    }
+
+    void setRasterThreads(int threads)
+    {
+        // Between frames only: the pool must be idle when it is resized
+        raster_threads = std::max(1, threads);
+        WorkerPool::setThreads(raster_threads);
+    }
 
-        XMoveResizeWindow(display, overlay_window, pos_x, pos_y, width, height);
-        cairo_xlib_surface_set_size(cairo_surface, width, height);
+    int getConnectionNumber()
+    {
+        return display ? ConnectionNumber(display) : -1;
+    }
+
+    bool hasQueuedEvents()
+    {
+        return display && XEventsQueued(display, QueuedAlready) > 0;
+    }
+
+    void setDamageTracking(bool enabled)
+    {
+        // Not implemented for the Cairo backend, every frame is fully repainted
+        (void)enabled;
+    }
+
+    ContextHandle createContext(const char* window_class)
+    {
+        if (!window_class || !*window_class)
+            return INVALID_CONTEXT;
+
+        ContextHandle handle = next_context_handle++;
+        contexts[handle].current_window_class = window_class;
+        return handle;
+    }
+
+    ContextHandle createContextForWindow(unsigned long window_id)
+    {
+        if (!window_id)
+            return INVALID_CONTEXT;
+
+        ContextHandle handle = next_context_handle++;
+        contexts[handle].fixed_window = window_id;
+        return handle;
+    }
+
+    void destroyContext(ContextHandle context)
+    {
+        auto it = contexts.find(context);
+        if (context == DEFAULT_CONTEXT || it == contexts.end())
+            return;
+
+        OverlayContext* previous = ctx == &it->second ? &contexts[DEFAULT_CONTEXT] : ctx;
+        ctx = &it->second;
+        if (ctx->overlay_initialized)
+            cleanupOverlayInternal();
+        ctx = previous;
+        contexts.erase(it);
+    }
+
+    bool setCurrentContext(ContextHandle context)
+    {
+        auto it = contexts.find(context);
+        if (it == contexts.end())
+            return false;
+        ctx = &it->second;
+        return true;
+    }
+
+    ContextHandle getCurrentContext()
+    {
+        for (auto& entry : contexts)
+        {
+            if (&entry.second == ctx)
+                return entry.first;
+        }
+        return DEFAULT_CONTEXT;
+    }
+
+    std::vector<ContextHandle> getContexts()
+    {
+        std::vector<ContextHandle> handles;
+        for (auto& entry : contexts)
+            handles.push_back(entry.first);
+        return handles;
+    }
+
+    void renderContexts(const std::function<void(ContextHandle)>& draw)
+    {
+        OverlayContext* previous = ctx;
+        batching = true;
+        FrameStats::beginFrame(); // One frame for the whole pass, however many overlays it paints
+        for (auto& entry : contexts)
+        {
+            ctx = &entry.second;
+            if (!tryInitialize(nullptr))
+                continue;
+
+            updateWindowPosition();
+            if (!ctx->overlay_initialized)
+                continue;
+
+            beginFrame();
+            if (draw)
+                draw(entry.first);
+            endFrame();
+        }
+        batching = false;
+        ctx = previous;
+
+        // Every overlay's requests go out together
+        if (display)
+            XFlush(display);
+        FrameStats::endFrame(display ? NextRequest(display) : 0);
+    }
+
+    DamageStats getDamageStats()
+    {
+        return ctx->damage_stats;
+    }
+
+    void preloadFonts(const std::vector<FontRequest>& fonts, const std::string& characters)
+    {
+        std::vector<FontPreload::Job> jobs;
+        for (const FontRequest& request : fonts)
+        {
+            FontPreload::Job job;
+            job.family = request.family.empty() ? "Consolas" : request.family;
+            job.size = request.size > 0 ? request.size : 20;
+            job.characters = characters;
+            jobs.push_back(job);
+        }
+        FontPreload::enqueue(jobs);
+    }
+
+    void setTextCacheCapacity(unsigned long entries)
+    {
+        layout_cache_capacity = entries;
+        evictLayouts(layout_cache_capacity);
+    }
+
+    TextCacheStats getTextCacheStats()
+    {
+        TextCacheStats stats;
+        stats.hits = layout_cache_hits;
+        stats.misses = layout_cache_misses;
+        stats.evictions = layout_cache_evictions;
+        stats.entries = layout_cache.size();
+        stats.capacity = layout_cache_capacity;
+        return stats;
+    }
+
+    void setLabelCacheBudget(unsigned long bytes)
+    {
+        label_cache_budget = bytes;
+        if (!bytes)
+            clearLabelCache();
+        else
+            evictLabels(bytes);
+    }
+
+    LabelCacheStats getLabelCacheStats()
+    {
+        LabelCacheStats stats;
+        stats.hits = label_cache_hits;
+        stats.misses = label_cache_misses;
+        stats.evictions = label_cache_evictions;
+        stats.entries = label_cache.size();
+        stats.bytes = label_cache_bytes;
+        stats.budget = label_cache_budget;
+        return stats;
     }
 
     int getWidth() 
     { 
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return 0;
-        return width; 
+        return ctx->width; 
     }
 
     int getHeight() 
     { 
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return 0;
-        return height; 
+        return ctx->height; 
     }
 } // namespace Overlay
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "draw.h"
+#include "font_preload.h"
+#include "frame_stats.h"
+#include "render_queue.h"
 #include <X11/Xatom.h>
 #include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
@@ -7,11 +10,18 @@
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/shape.h>
 #include <fontconfig/fontconfig.h>
+#include <png.h>
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
 #include <iostream>
+#include <list>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define COMPENSATE_SIZE
@@ -27,25 +37,138 @@ const double FONT_SIZE_COMPENSATION = 1.0;
 
 namespace
 {
+    // Shared by every overlay context
     Display* display = nullptr;
     int screen = 0;
-    Window target_window = 0;
-    Window overlay_window = 0;
     Colormap colormap = 0;
     Visual* visual = nullptr;
-    Pixmap back_buffer = 0;
-    XftDraw* back_draw = nullptr;
-    GC gc = nullptr;
-
-    int width = 0;
-    int height = 0;
-    int pos_x = 0;
-    int pos_y = 0;
-
-    bool overlay_initialized = false;
-    std::string current_window_class;
-    bool colors_initialized = false;
     bool x_error_occurred = false;
+    Overlay::TrackingMode tracking_mode = Overlay::TRACK_EVENTS;
+
+    // Target discovery: _NET_CLIENT_LIST first, then root PropertyNotify/MapNotify
+    // tell us when something new could match, instead of rescanning on a timer
+    Atom net_client_list = None;
+    bool discovery_watching = false;
+    bool have_client_list = false;      // Window manager publishes _NET_CLIENT_LIST
+
+    // Damage tracking: Draw calls are recorded and rasterized at endFrame, only
+    // where the recorded frame differs from the previous one
+    enum DrawCommandType
+    {
+        CMD_PLAIN,
+        CMD_OUTLINE,
+        CMD_BACKGROUND
+    };
+
+    struct DrawCommand
+    {
+        DrawCommandType type = CMD_PLAIN;
+        std::string text;
+        std::string font_family;
+        bool has_font_family = false;
+        int font_size = 0;
+        int x = 0;
+        int y = 0;
+        double r = 0, g = 0, b = 0;
+        double extra_r = 0, extra_g = 0, extra_b = 0, extra_a = 0; // Outline or background colour
+        double outline_width = 0;
+        int padding = 0;
+        Draw::TextAlignment alignment = Draw::ALIGN_LEFT;
+        XRectangle bounds{};
+        Draw::ElementHandle element = Draw::INVALID_ELEMENT; // Set when replaying a retained element
+        unsigned int revision = 0;
+        unsigned int generation = 0; // FontSet line metrics the bounds were measured with
+
+        bool operator==(const DrawCommand& o) const
+        {
+            // A fallback that grows the line height moves the baseline of unchanged text
+            if (generation != o.generation)
+                return false;
+
+            // Retained elements compare by revision, no need to look at the text
+            if (element != Draw::INVALID_ELEMENT || o.element != Draw::INVALID_ELEMENT)
+                return element == o.element && revision == o.revision;
+
+            return type == o.type && x == o.x && y == o.y && font_size == o.font_size &&
+                   alignment == o.alignment && padding == o.padding && outline_width == o.outline_width &&
+                   r == o.r && g == o.g && b == o.b &&
+                   extra_r == o.extra_r && extra_g == o.extra_g && extra_b == o.extra_b && extra_a == o.extra_a &&
+                   has_font_family == o.has_font_family && font_family == o.font_family && text == o.text;
+        }
+    };
+
+    const int DAMAGE_MARGIN = 2; // Glyph ink may overhang the advance width
+
+    bool damage_tracking = true;
+
+    // Damage bounds of a retained element, clamped to one context's overlay
+    struct ElementBounds
+    {
+        bool valid = false;
+        unsigned int revision = 0;   // Element revision they were measured for
+        unsigned int generation = 0; // FontSet line metrics they were measured with
+        int width = 0;               // Overlay size they were clamped to
+        int height = 0;
+        XRectangle rect{};
+    };
+
+    // One overlay and the target it follows. Everything else (display,
+    // fonts, glyphs, colours, text metrics, retained elements) is shared
+    // between contexts.
+    struct OverlayContext
+    {
+        Window target_window = 0;
+        Window fixed_window = 0; // Target given by ID instead of discovered by class
+        Window overlay_window = 0;
+        Pixmap back_buffer = 0;
+        XftDraw* back_draw = nullptr;
+        GC gc = nullptr;
+
+        int width = 0;
+        int height = 0;
+        int pos_x = 0;
+        int pos_y = 0;
+
+        bool overlay_initialized = false;
+        bool headless = false; // Rendering into back_buffer only, no target or overlay window
+        std::string current_window_class;
+
+        // Event-driven target tracking
+        std::vector<Window> tracked_windows; // Target window and its ancestors below root
+        bool geometry_dirty = false;
+        bool ancestors_dirty = false;
+        bool target_destroyed = false;
+
+        bool discovery_dirty = true;        // Client list changed since the last scan
+        bool discovery_walked = false;      // Full tree walk done for the current class
+        bool discovery_reported = false;
+        std::string discovery_class;
+        std::vector<Window> discovery_candidates;     // Top-level windows mapped since the last scan
+        std::unordered_set<Window> discovery_checked; // Clients known not to match
+
+        bool full_damage = true;
+        std::vector<DrawCommand> frame_commands;
+        std::vector<DrawCommand> previous_commands;
+        std::unordered_map<Draw::ElementHandle, ElementBounds> element_bounds;
+        Overlay::DamageStats damage_stats{};
+    };
+
+    // Map nodes never move, so ctx stays valid until its context is destroyed
+    std::map<Overlay::ContextHandle, OverlayContext> contexts;
+    Overlay::ContextHandle next_context_handle = Overlay::DEFAULT_CONTEXT + 1;
+    OverlayContext* ctx = &contexts[Overlay::DEFAULT_CONTEXT];
+    // Inside renderContexts, endFrame leaves the flush and the frame stats to it
+    bool batching = false;
+
+    // Retained text elements, drawn in creation order into every context
+    struct SceneElement
+    {
+        Draw::TextElement element;
+        unsigned int revision = 0;
+    };
+
+    std::map<Draw::ElementHandle, SceneElement> scene_elements;
+    Draw::ElementHandle next_element_handle = 1;
 
     // X error handler
     int xErrorHandler(Display* dpy, XErrorEvent* event)
@@ -61,25 +184,208 @@ namespace
         return 0;
     }
 
+    // Codepoints below this resolve through a flat table (Latin, IPA, modifiers)
+    const FcChar32 LATIN_FONT_RANGE = 0x300;
+
+    const char* const FALLBACK_FAMILIES[] = {
+        "Noto Color Emoji", "Noto Emoji", "EmojiOne Color", "Twitter Color Emoji",
+        "Segoe UI Symbol", "Symbola", "DejaVu Sans", "DejaVu Sans Mono", "Liberation Sans"};
+    const int FALLBACK_COUNT = sizeof(FALLBACK_FAMILIES) / sizeof(FALLBACK_FAMILIES[0]);
+
+    // What each fallback family covers, matched once for all sizes
+    struct FallbackCoverage
+    {
+        bool matched = false;
+        FcCharSet* charset = nullptr;
+    };
+
+    FallbackCoverage fallback_coverage[FALLBACK_COUNT];
+
+    // Fallback fonts of one size, shared by every primary family of that
+    // size and opened only when a codepoint needs them
+    struct FallbackPool
+    {
+        XftFont* fonts[FALLBACK_COUNT] = {};
+        bool tried[FALLBACK_COUNT] = {};
+    };
+
+    std::map<int, FallbackPool> fallback_pools; // Keyed on size, nodes never move
+
     struct FontSet
     {
         XftFont* primary = nullptr;
-        std::vector<XftFont*> fallbacks;
+        FallbackPool* fallbacks = nullptr;
+        int size = 0;
         int line_ascent = 0;
         int line_descent = 0;
         int font_height = 0;
+        // Line metrics grow as fallbacks get used; bumped when they do
+        unsigned int generation = 0;
+        unsigned int fallbacks_used = 0; // Bit per fallback family
+
+        // Codepoint -> font, filled lazily: 0 is unresolved, otherwise
+        // 1 + index into primary followed by the fallback families
+        unsigned char latin_fonts[LATIN_FONT_RANGE] = {};
+        std::unordered_map<FcChar32, unsigned char> other_fonts;
+    };
+
+    // Font registry: family names are interned to small ids, FontSets live in
+    // a deque (push_back never moves existing elements, so FontSet* stays
+    // valid) and are found by (family id, size) in one hash lookup
+    std::unordered_map<std::string, unsigned int> family_ids;
+    std::deque<FontSet> font_sets;
+    std::unordered_map<unsigned long long, FontSet*> font_set_index;
+
+    unsigned int internFamily(const std::string& family)
+    {
+        auto it = family_ids.find(family);
+        if (it != family_ids.end())
+            return it->second;
+
+        unsigned int id = static_cast<unsigned int>(family_ids.size());
+        family_ids.emplace(family, id);
+        return id;
+    }
+
+    unsigned long long fontSetKey(unsigned int family_id, int size)
+    {
+        return (static_cast<unsigned long long>(family_id) << 32) | static_cast<unsigned int>(size);
+    }
+
+    struct TextMetrics
+    {
+        // Glyphs are resolved once; x is relative to the start of their line,
+        // y to the baseline of the first line
+        std::vector<XftGlyphFontSpec> glyphs;
+        std::vector<size_t> line_starts; // Index of the first glyph of each line
+        std::vector<int> line_widths;
+        int width = 0;
+        int height = 0;
+        unsigned int generation = 0; // FontSet line metrics this was laid out with
+    };
+
+    // Text metrics keyed on (FontSet, text), most recently used first
+    struct TextMetricsEntry
+    {
+        FontSet* font_set = nullptr;
+        std::string text;
+        TextMetrics metrics;
     };
 
-    struct FontCacheEntry
+    typedef std::list<TextMetricsEntry> TextMetricsList;
+
+    TextMetricsList text_metrics_lru;
+    std::unordered_map<FontSet*, std::unordered_map<std::string, TextMetricsList::iterator>> text_metrics_index;
+    unsigned long text_metrics_capacity = 512;
+    unsigned long long text_metrics_hits = 0;
+    unsigned long long text_metrics_misses = 0;
+    unsigned long long text_metrics_evictions = 0;
+
+    void evictTextMetrics(unsigned long capacity)
+    {
+        while (text_metrics_lru.size() > capacity)
+        {
+            TextMetricsEntry& victim = text_metrics_lru.back();
+            auto by_font = text_metrics_index.find(victim.font_set);
+            by_font->second.erase(victim.text);
+            if (by_font->second.empty())
+                text_metrics_index.erase(by_font);
+            text_metrics_lru.pop_back();
+            text_metrics_evictions++;
+        }
+    }
+
+    void clearTextMetrics()
+    {
+        text_metrics_lru.clear();
+        text_metrics_index.clear();
+    }
+
+    // Pre-rendered labels keyed on everything a command paints except its
+    // position, most recently used first
+    struct LabelTexture
     {
-        std::string family;
-        int size;
-        FontSet font_set;
+        std::string key;
+        Pixmap pixmap = 0; // Zero only if the label had nothing to draw
+        XftDraw* draw = nullptr;
+        int origin_x = 0;  // Pixmap corner relative to the command's x, y
+        int origin_y = 0;
+        int width = 0;
+        int height = 0;
+        unsigned long bytes = 0;
     };
 
-    std::vector<FontCacheEntry> font_cache;
+    std::list<LabelTexture> label_cache;
+    std::unordered_map<std::string, std::list<LabelTexture>::iterator> label_cache_index;
+    unsigned long label_cache_budget = 8ul << 20;
+    unsigned long label_cache_bytes = 0;
+    unsigned long long label_cache_hits = 0;
+    unsigned long long label_cache_misses = 0;
+    unsigned long long label_cache_evictions = 0;
+    GC label_gc = nullptr; // Unclipped, unlike ctx->gc while damage is repainted
+
+    // Hashes of labels drawn once so far, newest first. Only a label found
+    // here gets a texture, and this list is capped on its own
+    const size_t LABEL_SEEN_CAPACITY = 256;
+    std::list<size_t> label_seen;
+    std::unordered_map<size_t, std::list<size_t>::iterator> label_seen_index;
+
+    void releaseLabelTexture(LabelTexture& texture)
+    {
+        if (texture.draw)
+            XftDrawDestroy(texture.draw);
+        if (texture.pixmap)
+            XFreePixmap(display, texture.pixmap);
+        texture.draw = nullptr;
+        texture.pixmap = 0;
+    }
+
+    void evictLabels(unsigned long budget)
+    {
+        // The front entry is the one being drawn and stays, whatever its size
+        while (label_cache_bytes > budget && label_cache.size() > 1)
+        {
+            LabelTexture& victim = label_cache.back();
+            releaseLabelTexture(victim);
+            label_cache_bytes -= victim.bytes;
+            label_cache_index.erase(victim.key);
+            label_cache.pop_back();
+            label_cache_evictions++;
+        }
+    }
+
+    void clearLabelCache()
+    {
+        for (LabelTexture& texture : label_cache)
+            releaseLabelTexture(texture);
+        label_cache.clear();
+        label_cache_index.clear();
+        label_cache_bytes = 0;
+        label_seen.clear();
+        label_seen_index.clear();
+    }
+
+    // True for the second sighting of a key; the first one is only recorded
+    bool labelSeenBefore(const std::string& key)
+    {
+        size_t hash = std::hash<std::string>()(key);
+        auto it = label_seen_index.find(hash);
+        if (it != label_seen_index.end())
+        {
+            label_seen.erase(it->second);
+            label_seen_index.erase(it);
+            return true;
+        }
 
-    XftColor xft_white, xft_black, xft_ltblue, xft_outline;
+        label_seen.push_front(hash);
+        label_seen_index[hash] = label_seen.begin();
+        if (label_seen.size() > LABEL_SEEN_CAPACITY)
+        {
+            label_seen_index.erase(label_seen.back());
+            label_seen.pop_back();
+        }
+        return false;
+    }
 
     bool utf8_next(const char* s, int len, int& i, FcChar32& out)
     {
@@ -110,25 +416,76 @@ namespace
         return true;
     }
 
-    XftColor createXftColor(double r, double g, double b, double a = 1.0)
+    // Colours keyed on RGBA quantized to 8 bits per channel. On a TrueColor
+    // visual the pixel is computed locally, otherwise it is allocated once
+    // and freed in releaseSharedResources.
+    const size_t COLOR_CACHE_LIMIT = 1024;
+    std::unordered_map<unsigned int, XftColor> color_cache;
+
+    unsigned int quantizeChannel(double v)
+    {
+        return static_cast<unsigned int>(std::min(std::max(v, 0.0), 1.0) * 255.0 + 0.5);
+    }
+
+    unsigned long maskChannel(unsigned short value, unsigned long mask)
+    {
+        if (!mask)
+            return 0;
+        int shift = __builtin_ctzl(mask);
+        int bits = __builtin_popcountl(mask);
+        return (static_cast<unsigned long>(value >> (16 - bits)) << shift) & mask;
+    }
+
+    void freeColorCache()
+    {
+        if (visual && visual->c_class != TrueColor)
+        {
+            for (auto& entry : color_cache)
+                XftColorFree(display, visual, colormap, &entry.second);
+        }
+        color_cache.clear();
+    }
+
+    XftColor getXftColor(double r, double g, double b, double a = 1.0)
     {
+        unsigned int key = (quantizeChannel(r) << 24) | (quantizeChannel(g) << 16) | (quantizeChannel(b) << 8) |
+                           quantizeChannel(a);
+        auto it = color_cache.find(key);
+        if (it != color_cache.end())
+            return it->second;
+
+        // Colours are returned by value, so dropping the lot is always safe
+        if (color_cache.size() >= COLOR_CACHE_LIMIT)
+            freeColorCache();
+
         XRenderColor rc;
-        rc.red = static_cast<unsigned short>(r * 65535.0);
-        rc.green = static_cast<unsigned short>(g * 65535.0);
-        rc.blue = static_cast<unsigned short>(b * 65535.0);
-        rc.alpha = static_cast<unsigned short>(a * 65535.0);
+        rc.red = static_cast<unsigned short>((key >> 24) * 257);
+        rc.green = static_cast<unsigned short>(((key >> 16) & 0xff) * 257);
+        rc.blue = static_cast<unsigned short>(((key >> 8) & 0xff) * 257);
+        rc.alpha = static_cast<unsigned short>((key & 0xff) * 257);
 
         XftColor color;
-        if (!XftColorAllocValue(display, visual, colormap, &rc, &color))
+        color.color = rc;
+
+        if (visual->c_class == TrueColor)
+        {
+            // Same pixel XftColorAllocValue would compute, without the library round trip
+            color.pixel = maskChannel(rc.red, visual->red_mask) | maskChannel(rc.green, visual->green_mask) |
+                          maskChannel(rc.blue, visual->blue_mask);
+        }
+        else if (!XftColorAllocValue(display, visual, colormap, &rc, &color))
         {
             std::cerr << "Cannot create Xft color\n";
-            // Return a default color instead of aborting
+            // Fall back to opaque black instead of aborting
             color.pixel = 0;
             color.color.red = 0;
             color.color.green = 0;
             color.color.blue = 0;
             color.color.alpha = 65535;
+            return color;
         }
+
+        color_cache[key] = color;
         return color;
     }
 
@@ -200,6 +557,7 @@ namespace
         x_error_occurred = false;
         
         XWindowAttributes attr;
+        FrameStats::countRoundTrip();
         if (!XGetWindowAttributes(display, win, &attr))
         {
             if (!x_error_occurred) {
@@ -215,6 +573,7 @@ namespace
 
         Window child;
         int x, y;
+        FrameStats::countRoundTrip();
         if (!XTranslateCoordinates(display, win, DefaultRootWindow(display), 0, 0, &x, &y, &child))
         {
             if (!x_error_occurred) {
@@ -228,10 +587,10 @@ namespace
             return false;
         }
 
-        pos_x = x;
-        pos_y = y;
-        width = attr.width;
-        height = attr.height;
+        ctx->pos_x = x;
+        ctx->pos_y = y;
+        ctx->width = attr.width;
+        ctx->height = attr.height;
         
         return true;
     }
@@ -253,11 +612,9 @@ namespace
         return XftFontOpenPattern(display, match);
     }
 
-    FontSet* getFontSet(const char* font_family, int font_size)
+    int compensatedFontSize(int font_size)
     {
-        // Use default values if not specified
-        const char* family = font_family ? font_family : "Consolas";
-        int size = font_size > 0 ? 
+        return font_size > 0 ? 
 #ifdef COMPENSATE_SIZE
     static_cast<int>(font_size * FONT_SIZE_COMPENSATION)
 #else
@@ -270,153 +627,191 @@ namespace
     20
 #endif
     ;
+    }
 
-        // Check if we already have this font cached
-        for (auto& entry : font_cache)
+    // match, when given, is a ready FcFontMatch result for (family, size)
+    // and is consumed either way
+    FontSet* findOrCreateFontSet(const std::string& family, int size, FcPattern* match = nullptr)
+    {
+        unsigned long long key = fontSetKey(internFamily(family), size);
+        auto it = font_set_index.find(key);
+        if (it != font_set_index.end())
         {
-            if (entry.family == family && entry.size == size)
-            {
-                return &entry.font_set;
-            }
+            if (match)
+                FcPatternDestroy(match);
+            return it->second;
         }
 
-        // Create new font set
-        FontCacheEntry new_entry;
-        new_entry.family = family;
-        new_entry.size = size;
+        font_sets.emplace_back();
+        FontSet& font_set = font_sets.back();
+        font_set_index[key] = &font_set;
 
         // Load primary font
-        new_entry.font_set.primary = openFontByFamily(family, size);
-        if (!new_entry.font_set.primary)
+        font_set.primary = match ? XftFontOpenPattern(display, match) : openFontByFamily(family.c_str(), size);
+        if (!font_set.primary)
         {
             std::cerr << "Failed to load primary font: " << family << "\n";
             // Fallback to default font
-            new_entry.font_set.primary = openFontByFamily("Consolas", 20);
-        }
-
-        // Load fallback fonts
-        const char* fallbackFamilies[] = {
-            "Noto Color Emoji", "Noto Emoji", "EmojiOne Color", "Twitter Color Emoji",
-            "Segoe UI Symbol", "Symbola", "DejaVu Sans", "DejaVu Sans Mono", "Liberation Sans"};
-        for (const char* fam : fallbackFamilies)
-        {
-            if (auto* f = openFontByFamily(fam, size))
-            {
-                new_entry.font_set.fallbacks.push_back(f);
-            }
+            font_set.primary = openFontByFamily("Consolas", 20);
         }
 
-        // Compute line metrics
-        new_entry.font_set.line_ascent = 0;
-        new_entry.font_set.line_descent = 0;
-        if (new_entry.font_set.primary)
-        {
-            new_entry.font_set.line_ascent = std::max(new_entry.font_set.line_ascent, new_entry.font_set.primary->ascent);
-            new_entry.font_set.line_descent = std::max(new_entry.font_set.line_descent, new_entry.font_set.primary->descent);
-        }
-        for (auto* f : new_entry.font_set.fallbacks)
+        // Fallbacks open on demand and only widen the line metrics once used
+        font_set.fallbacks = &fallback_pools[size];
+        font_set.size = size;
+        if (font_set.primary)
         {
-            if (!f)
-                continue;
-            new_entry.font_set.line_ascent = std::max(new_entry.font_set.line_ascent, f->ascent);
-            new_entry.font_set.line_descent = std::max(new_entry.font_set.line_descent, f->descent);
+            font_set.line_ascent = font_set.primary->ascent;
+            font_set.line_descent = font_set.primary->descent;
         }
-        new_entry.font_set.font_height = new_entry.font_set.line_ascent + new_entry.font_set.line_descent;
+        font_set.font_height = font_set.line_ascent + font_set.line_descent;
+        return &font_set;
+    }
 
-        font_cache.push_back(new_entry);
-        return &font_cache.back().font_set;
+    FontSet* getFontSet(const char* font_family, int font_size)
+    {
+        // Use default values if not specified
+        return findOrCreateFontSet(font_family ? font_family : "Consolas", compensatedFontSize(font_size));
     }
 
-    XftFont* pickFontForChar(FontSet* font_set, FcChar32 ch)
+    FcCharSet* fallbackCoverage(int index)
     {
-        if (font_set->primary && XftCharExists(display, font_set->primary, ch))
-            return font_set->primary;
+        FallbackCoverage& coverage = fallback_coverage[index];
+        if (coverage.matched)
+            return coverage.charset;
+
+        coverage.matched = true;
+        FcPattern* pat = FcPatternCreate();
+        FcPatternAddString(pat, FC_FAMILY, (const FcChar8*)FALLBACK_FAMILIES[index]);
+        FcConfigSubstitute(nullptr, pat, FcMatchPattern);
+        FcDefaultSubstitute(pat);
 
-        for (auto* f : font_set->fallbacks)
-            if (f && XftCharExists(display, f, ch))
-                return f;
+        FcResult result;
+        FcPattern* match = FcFontMatch(nullptr, pat, &result);
+        FcPatternDestroy(pat);
+        if (!match)
+            return nullptr;
 
-        return font_set->primary;
+        FcCharSet* charset = nullptr;
+        if (FcPatternGetCharSet(match, FC_CHARSET, 0, &charset) == FcResultMatch)
+            coverage.charset = FcCharSetCopy(charset);
+        FcPatternDestroy(match);
+        return coverage.charset;
     }
 
-    struct TextMetrics
+    XftFont* fallbackFont(FallbackPool* pool, int index, int size)
     {
-        std::vector<std::pair<XftFont*, std::string>> runs;
-        std::vector<int> line_widths;
-        int width = 0;
-        int height = 0;
-    };
-
-    std::map<std::string, TextMetrics> textMetricsCache;
+        if (!pool->tried[index])
+        {
+            pool->tried[index] = true;
+            pool->fonts[index] = openFontByFamily(FALLBACK_FAMILIES[index], size);
+        }
+        return pool->fonts[index];
+    }
 
-    void utf8ToFontRuns(const char* text, int len, std::vector<std::pair<XftFont*, std::string>>& runs, FontSet* font_set)
+    // Index of the first font covering ch, the primary when none does
+    unsigned char resolveFontIndex(FontSet* font_set, FcChar32 ch)
     {
-        int i = 0;
-        XftFont* current = nullptr;
-        std::string buf;
+        if (font_set->primary && FcCharSetHasChar(font_set->primary->charset, ch))
+            return 0;
 
-        while (i < len)
+        for (int i = 0; i < FALLBACK_COUNT; i++)
         {
-            FcChar32 cp;
-            int before = i;
-            utf8_next(text, len, i, cp);
-
-            if (cp == '\n')
-            {
-                if (!buf.empty() && current)
-                {
-                    runs.push_back({current, buf});
-                    buf.clear();
-                }
-                runs.push_back({nullptr, "\n"});
-                current = nullptr;
+            // Family coverage is checked first, so fonts that cannot help are never opened
+            FcCharSet* coverage = fallbackCoverage(i);
+            if (!coverage || !FcCharSetHasChar(coverage, ch))
                 continue;
-            }
 
-            XftFont* f = pickFontForChar(font_set, cp);
+            XftFont* f = fallbackFont(font_set->fallbacks, i, font_set->size);
+            if (f && FcCharSetHasChar(f->charset, ch))
+                return static_cast<unsigned char>(i + 1);
+        }
+        return 0;
+    }
 
-            if (current == nullptr)
-                current = f;
-            if (f != current)
-            {
-                if (!buf.empty())
-                    runs.push_back({current, buf});
-                buf.clear();
-                current = f;
-            }
-            buf.append(text + before, i - before);
+    void useFallback(FontSet* font_set, int index)
+    {
+        if (font_set->fallbacks_used & (1u << index))
+            return;
+        font_set->fallbacks_used |= 1u << index;
+
+        XftFont* f = font_set->fallbacks->fonts[index];
+        if (f->ascent > font_set->line_ascent || f->descent > font_set->line_descent)
+        {
+            font_set->line_ascent = std::max(font_set->line_ascent, f->ascent);
+            font_set->line_descent = std::max(font_set->line_descent, f->descent);
+            font_set->font_height = font_set->line_ascent + font_set->line_descent;
+            font_set->generation++;
         }
-        if (!buf.empty() && current)
-            runs.push_back({current, buf});
     }
 
-    TextMetrics computeTextMetrics(const std::string& text, FontSet* font_set)
+    XftFont* pickFontForChar(FontSet* font_set, FcChar32 ch)
     {
-        auto it = textMetricsCache.find(text);
-        if (it != textMetricsCache.end())
-            return it->second;
+        unsigned char& slot = ch < LATIN_FONT_RANGE ? font_set->latin_fonts[ch] : font_set->other_fonts[ch];
+        if (!slot)
+        {
+            slot = resolveFontIndex(font_set, ch) + 1;
+            if (slot > 1)
+                useFallback(font_set, slot - 2);
+        }
+
+        return slot == 1 ? font_set->primary : font_set->fallbacks->fonts[slot - 2];
+    }
+
+    void freeFallbackFonts()
+    {
+        for (auto& pool : fallback_pools)
+        {
+            for (XftFont* f : pool.second.fonts)
+                if (f)
+                    XftFontClose(display, f);
+        }
+        fallback_pools.clear();
 
-        TextMetrics tm;
-        utf8ToFontRuns(text.c_str(), static_cast<int>(text.size()), tm.runs, font_set);
+        for (FallbackCoverage& coverage : fallback_coverage)
+        {
+            if (coverage.charset)
+                FcCharSetDestroy(coverage.charset);
+            coverage = FallbackCoverage();
+        }
+    }
 
+    void layoutText(TextMetrics& tm, const std::string& text, FontSet* font_set)
+    {
+        tm.glyphs.clear();
+        tm.line_starts.assign(1, 0);
         tm.line_widths.clear();
+
+        const char* str = text.c_str();
+        int len = static_cast<int>(text.size());
+        int i = 0;
         int current_line_width = 0;
         int line_count = 1;
 
-        for (auto& r : tm.runs)
+        FcChar32 cp;
+        while (utf8_next(str, len, i, cp))
         {
-            if (r.first == nullptr && r.second == "\n")
+            if (cp == '\n')
             {
                 tm.line_widths.push_back(current_line_width);
+                tm.line_starts.push_back(tm.glyphs.size());
                 current_line_width = 0;
                 line_count++;
                 continue;
             }
 
+            XftFont* font = pickFontForChar(font_set, cp);
+            if (!font)
+                continue;
+
+            XftGlyphFontSpec spec;
+            spec.font = font;
+            spec.glyph = XftCharIndex(display, font, cp);
+            spec.x = static_cast<short>(current_line_width);
+            spec.y = static_cast<short>((line_count - 1) * font_set->font_height);
+            tm.glyphs.push_back(spec);
+
             XGlyphInfo gi;
-            XftTextExtentsUtf8(display, r.first,
-                               (const FcChar8*)r.second.c_str(),
-                               (int)r.second.size(), &gi);
+            XftGlyphExtents(display, font, &spec.glyph, 1, &gi);
             current_line_width += gi.xOff;
         }
 
@@ -432,163 +827,343 @@ namespace
         }
 
         tm.height = line_count * font_set->font_height;
+    }
+
+    const TextMetrics& computeTextMetrics(const std::string& text, FontSet* font_set)
+    {
+        auto by_font = text_metrics_index.find(font_set);
+        if (by_font != text_metrics_index.end())
+        {
+            auto it = by_font->second.find(text);
+            if (it != by_font->second.end())
+            {
+                if (it->second->metrics.generation == font_set->generation)
+                {
+                    text_metrics_lru.splice(text_metrics_lru.begin(), text_metrics_lru, it->second);
+                    text_metrics_hits++;
+                    return it->second->metrics;
+                }
+                // Laid out before a fallback font made the lines taller
+                text_metrics_lru.erase(it->second);
+                by_font->second.erase(it);
+            }
+        }
+
+        FrameStats::ScopedPhase phase(Overlay::METRIC_TEXT_LAYOUT);
+        text_metrics_misses++;
+        text_metrics_lru.push_front(TextMetricsEntry());
+        TextMetricsEntry& entry = text_metrics_lru.front();
+        entry.font_set = font_set;
+        entry.text = text;
+        text_metrics_index[font_set][text] = text_metrics_lru.begin();
+
+        // The entry just added is at the front and never evicted here
+        evictTextMetrics(std::max(text_metrics_capacity, 1ul));
+
+        // Opening a fallback can change the line height halfway through
+        TextMetrics& tm = entry.metrics;
+        do
+        {
+            tm.generation = font_set->generation;
+            layoutText(tm, text, font_set);
+        } while (tm.generation != font_set->generation);
 
-        textMetricsCache.emplace(text, tm);
         return tm;
     }
 
-    void drawTextRuns(const TextMetrics& tm, int x, int baselineY, const XftColor* col,
-                      FontSet* font_set, Draw::TextAlignment alignment)
+    // Opens fonts the preload thread has matched: all of them while no overlay
+    // is on screen yet, otherwise one per frame, since a single font can take
+    // longer than a frame
+    void warmPreloadedFonts(bool all)
     {
-        int line_index = 0;
-        int penX = x;
-        int penY = baselineY;
-
-        // Adjust initial X position based on alignment for the first line
-        if (alignment != Draw::ALIGN_LEFT && !tm.line_widths.empty())
+        FontPreload::Job job;
+        while (FontPreload::takeResolved(job))
         {
-            if (alignment == Draw::ALIGN_CENTER)
-                penX = x - tm.line_widths[0] / 2;
-            else if (alignment == Draw::ALIGN_RIGHT)
-                penX = x - tm.line_widths[0];
+            FontSet* font_set = findOrCreateFontSet(job.family, job.size, job.match);
+            // Resolving the glyphs loads them into Xft and uploads them to the server
+            if (!job.characters.empty())
+                computeTextMetrics(job.characters, font_set);
+            FontPreload::markReady();
+            if (!all)
+                break;
         }
+    }
+
+    std::vector<XftGlyphFontSpec> glyph_scratch; // Reused across draws to avoid allocations
+
+    int alignmentOffset(const TextMetrics& tm, size_t line, Draw::TextAlignment alignment)
+    {
+        if (alignment == Draw::ALIGN_CENTER)
+            return -tm.line_widths[line] / 2;
+        if (alignment == Draw::ALIGN_RIGHT)
+            return -tm.line_widths[line];
+        return 0;
+    }
 
-        for (auto& r : tm.runs)
+    void appendPlacedGlyphs(const TextMetrics& tm, int x, int baselineY, Draw::TextAlignment alignment,
+                            std::vector<XftGlyphFontSpec>& out)
+    {
+        for (size_t line = 0; line < tm.line_starts.size(); ++line)
         {
-            if (r.first == nullptr && r.second == "\n")
+            size_t end = line + 1 < tm.line_starts.size() ? tm.line_starts[line + 1] : tm.glyphs.size();
+            int line_x = x + alignmentOffset(tm, line, alignment);
+            for (size_t i = tm.line_starts[line]; i < end; ++i)
             {
-                line_index++;
-                penY += font_set->font_height;
-
-                // Reset X position for the new line based on alignment
-                penX = x;
-                if (alignment != Draw::ALIGN_LEFT && line_index < tm.line_widths.size())
-                {
-                    if (alignment == Draw::ALIGN_CENTER)
-                        penX = x - tm.line_widths[line_index] / 2;
-                    else if (alignment == Draw::ALIGN_RIGHT)
-                        penX = x - tm.line_widths[line_index];
-                }
-                continue;
+                XftGlyphFontSpec spec = tm.glyphs[i];
+                spec.x = static_cast<short>(spec.x + line_x);
+                spec.y = static_cast<short>(spec.y + baselineY);
+                out.push_back(spec);
             }
-
-            XGlyphInfo gi;
-            XftTextExtentsUtf8(display, r.first,
-                               (const FcChar8*)r.second.c_str(),
-                               (int)r.second.size(), &gi);
-            XftDrawStringUtf8(back_draw, col, r.first, penX, penY,
-                              (const FcChar8*)r.second.c_str(), (int)r.second.size());
-            penX += gi.xOff;
         }
     }
 
-    void drawTextRunsOutline(const TextMetrics& tm, int x, int baselineY,
-                             const XftColor* fg, const XftColor* outline_color,
-                             FontSet* font_set, Draw::TextAlignment alignment, int outline_thickness = 2)
+    void drawGlyphs(const TextMetrics& tm, int x, int baselineY, const XftColor* col,
+                    Draw::TextAlignment alignment)
+    {
+        // Whole label in one request batch, whatever fonts it mixes
+        glyph_scratch.clear();
+        appendPlacedGlyphs(tm, x, baselineY, alignment, glyph_scratch);
+        if (!glyph_scratch.empty())
+            XftDrawGlyphFontSpec(ctx->back_draw, col, glyph_scratch.data(), static_cast<int>(glyph_scratch.size()));
+    }
+
+    // Outline masks: each glyph dilated by the outline radius, rasterized once
+    // and uploaded to a per (font, radius) A8 glyph set
+    struct OutlineGlyphSet
     {
-        const int offsets[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+        GlyphSet glyph_set = 0;
+        double radius = 0;
+        std::unordered_set<FT_UInt> loaded;
+    };
 
-        int line_index = 0;
-        int penX = x;
-        int penY = baselineY;
+    std::map<std::pair<XftFont*, int>, OutlineGlyphSet> outline_glyph_sets;
+    std::vector<unsigned int> outline_ids;
+    std::vector<XGlyphElt32> outline_elts;
 
-        // Adjust initial X position based on alignment for the first line
-        if (alignment != Draw::ALIGN_LEFT && !tm.line_widths.empty())
+    void dilateMask(const std::vector<unsigned char>& src, int src_w, int src_h, int pad, double radius,
+                    std::vector<unsigned char>& out, int out_stride)
+    {
+        // Max filter over a disc with an antialiased rim
+        int out_w = src_w + 2 * pad;
+        int out_h = src_h + 2 * pad;
+        int reach = static_cast<int>(std::ceil(radius));
+
+        std::vector<std::pair<int, int>> taps;
+        std::vector<int> weights;
+        for (int dy = -reach; dy <= reach; ++dy)
         {
-            if (alignment == Draw::ALIGN_CENTER)
-                penX = x - tm.line_widths[0] / 2;
-            else if (alignment == Draw::ALIGN_RIGHT)
-                penX = x - tm.line_widths[0];
+            for (int dx = -reach; dx <= reach; ++dx)
+            {
+                double coverage = radius + 0.5 - std::sqrt(double(dx * dx + dy * dy));
+                if (coverage <= 0.0)
+                    continue;
+                taps.push_back({dx, dy});
+                weights.push_back(static_cast<int>(std::min(coverage, 1.0) * 255.0 + 0.5));
+            }
         }
 
-        for (auto& r : tm.runs)
+        for (int oy = 0; oy < out_h; ++oy)
         {
-            if (r.first == nullptr && r.second == "\n")
+            for (int ox = 0; ox < out_w; ++ox)
             {
-                line_index++;
-                penY += font_set->font_height;
-
-                // Reset X position for the new line based on alignment
-                penX = x;
-                if (alignment != Draw::ALIGN_LEFT && line_index < tm.line_widths.size())
+                int best = 0;
+                for (size_t t = 0; t < taps.size() && best < 255; ++t)
                 {
-                    if (alignment == Draw::ALIGN_CENTER)
-                        penX = x - tm.line_widths[line_index] / 2;
-                    else if (alignment == Draw::ALIGN_RIGHT)
-                        penX = x - tm.line_widths[line_index];
+                    int sx = ox - pad + taps[t].first;
+                    int sy = oy - pad + taps[t].second;
+                    if (sx < 0 || sy < 0 || sx >= src_w || sy >= src_h)
+                        continue;
+                    int v = src[sy * src_w + sx] * weights[t] / 255;
+                    if (v > best)
+                        best = v;
                 }
-                continue;
+                out[oy * out_stride + ox] = static_cast<unsigned char>(best);
             }
+        }
+    }
 
-            for (int i = 0; i < 8; ++i)
-            {
-                int outlineX = penX + offsets[i][0] * outline_thickness;
-                int outlineY = penY + offsets[i][1] * outline_thickness;
+    void loadOutlineGlyph(OutlineGlyphSet& set, XftFont* font, FT_UInt glyph)
+    {
+        XGlyphInfo gi;
+        XftGlyphExtents(display, font, &glyph, 1, &gi);
 
-                XGlyphInfo gi;
-                XftTextExtentsUtf8(display, r.first,
-                                   (const FcChar8*)r.second.c_str(),
-                                   (int)r.second.size(), &gi);
-                XftDrawStringUtf8(back_draw, outline_color, r.first, outlineX, outlineY,
-                                  (const FcChar8*)r.second.c_str(), (int)r.second.size());
+        // Let Xft rasterize the glyph into an A8 pixmap, so bitmap and colour
+        // fonts come out at the size they are drawn at
+        std::vector<unsigned char> coverage(gi.width * gi.height, 0);
+        if (gi.width && gi.height)
+        {
+            XRenderPictFormat* a8 = XRenderFindStandardFormat(display, PictStandardA8);
+            Pixmap pixmap = XCreatePixmap(display, DefaultRootWindow(display), gi.width, gi.height, 8);
+            Picture picture = XRenderCreatePicture(display, pixmap, a8, 0, nullptr);
+            XRenderColor transparent = {0, 0, 0, 0};
+            XRenderColor opaque = {0xffff, 0xffff, 0xffff, 0xffff};
+            XRenderFillRectangle(display, PictOpSrc, picture, &transparent, 0, 0, gi.width, gi.height);
+            Picture white = XRenderCreateSolidFill(display, &opaque);
+            XftGlyphRender(display, PictOpOver, white, font, picture, 0, 0, gi.x, gi.y, &glyph, 1);
+
+            FrameStats::countRoundTrip();
+            XImage* image = XGetImage(display, pixmap, 0, 0, gi.width, gi.height, AllPlanes, ZPixmap);
+            if (image)
+            {
+                for (int y = 0; y < gi.height; ++y)
+                    for (int x = 0; x < gi.width; ++x)
+                        coverage[y * gi.width + x] = static_cast<unsigned char>(XGetPixel(image, x, y));
+                XDestroyImage(image);
             }
 
-            XGlyphInfo gi;
-            XftTextExtentsUtf8(display, r.first,
-                               (const FcChar8*)r.second.c_str(),
-                               (int)r.second.size(), &gi);
-            XftDrawStringUtf8(back_draw, fg, r.first, penX, penY,
-                              (const FcChar8*)r.second.c_str(), (int)r.second.size());
-            penX += gi.xOff;
+            XRenderFreePicture(display, white);
+            XRenderFreePicture(display, picture);
+            XFreePixmap(display, pixmap);
         }
+
+        int pad = static_cast<int>(std::ceil(set.radius)) + 1;
+        int out_w = gi.width + 2 * pad;
+        int out_h = gi.height + 2 * pad;
+        int stride = (out_w + 3) & ~3; // A8 glyph rows are padded to 32 bits
+        std::vector<unsigned char> mask(stride * out_h, 0);
+        dilateMask(coverage, gi.width, gi.height, pad, set.radius, mask, stride);
+
+        XGlyphInfo info;
+        info.width = static_cast<unsigned short>(out_w);
+        info.height = static_cast<unsigned short>(out_h);
+        info.x = static_cast<short>(gi.x + pad);
+        info.y = static_cast<short>(gi.y + pad);
+        info.xOff = 0; // Glyphs are positioned explicitly, see drawGlyphsOutline
+        info.yOff = 0;
+
+        Glyph id = glyph;
+        XRenderAddGlyphs(display, set.glyph_set, &id, &info, 1,
+                         reinterpret_cast<const char*>(mask.data()), static_cast<int>(mask.size()));
+        set.loaded.insert(glyph);
     }
 
-    void createOverlayWindow()
+    OutlineGlyphSet& getOutlineGlyphSet(XftFont* font, double radius)
     {
-        XVisualInfo vinfo;
-        if (!XMatchVisualInfo(display, DefaultScreen(display), 32, TrueColor, &vinfo))
+        int radius_q = static_cast<int>(std::lround(radius * 4.0)); // Quarter pixel steps
+        OutlineGlyphSet& set = outline_glyph_sets[std::make_pair(font, radius_q)];
+        if (!set.glyph_set)
         {
-            std::cerr << "No 32-bit TrueColor visual available\n";
-            return;
+            set.glyph_set = XRenderCreateGlyphSet(display, XRenderFindStandardFormat(display, PictStandardA8));
+            set.radius = radius_q / 4.0;
         }
-        visual = vinfo.visual;
-
-        colormap = XCreateColormap(display, DefaultRootWindow(display), vinfo.visual, AllocNone);
+        return set;
+    }
 
-        XSetWindowAttributes attr{};
-        attr.background_pixmap = None;
-        attr.background_pixel = rgba_to_pixel(0, 0, 0, 0);
-        attr.border_pixel = 0;
-        attr.win_gravity = NorthWestGravity;
-        attr.bit_gravity = ForgetGravity;
-        attr.save_under = 1;
-        attr.event_mask = BASIC_EVENT_MASK;
-        attr.do_not_propagate_mask = NOT_PROPAGATE_MASK;
-        attr.override_redirect = 1;
-        attr.colormap = colormap;
-        attr.backing_store = Always;
+    void freeOutlineGlyphSets()
+    {
+        for (auto& entry : outline_glyph_sets)
+            XRenderFreeGlyphSet(display, entry.second.glyph_set);
+        outline_glyph_sets.clear();
+    }
 
-        unsigned long mask = CWColormap | CWBorderPixel | CWBackPixel | CWEventMask |
-                             CWWinGravity | CWBitGravity | CWSaveUnder | CWDontPropagate |
-                             CWOverrideRedirect | CWBackingStore;
+    void drawGlyphsOutline(const TextMetrics& tm, int x, int baselineY,
+                           const XftColor* fg, const XftColor* outline_color,
+                           Draw::TextAlignment alignment, double outline_width)
+    {
+        double radius = std::max(1.0, outline_width);
 
-        overlay_window = XCreateWindow(display, DefaultRootWindow(display),
-                                       pos_x, pos_y, width, height, 0,
-                                       vinfo.depth, InputOutput, vinfo.visual, mask, &attr);
+        glyph_scratch.clear();
+        appendPlacedGlyphs(tm, x, baselineY, alignment, glyph_scratch);
+        if (glyph_scratch.empty())
+            return;
 
-        back_buffer = XCreatePixmap(display, overlay_window, width, height, vinfo.depth);
+        // One element per glyph, offsets are relative to the previous glyph
+        outline_ids.resize(glyph_scratch.size());
+        outline_elts.resize(glyph_scratch.size());
+        int pen_x = 0, pen_y = 0;
+        for (size_t i = 0; i < glyph_scratch.size(); ++i)
+        {
+            const XftGlyphFontSpec& spec = glyph_scratch[i];
+            OutlineGlyphSet& set = getOutlineGlyphSet(spec.font, radius);
+            if (!set.loaded.count(spec.glyph))
+                loadOutlineGlyph(set, spec.font, spec.glyph);
+
+            outline_ids[i] = spec.glyph;
+            outline_elts[i].glyphset = set.glyph_set;
+            outline_elts[i].chars = &outline_ids[i];
+            outline_elts[i].nchars = 1;
+            outline_elts[i].xOff = spec.x - pen_x;
+            outline_elts[i].yOff = spec.y - pen_y;
+            pen_x = spec.x;
+            pen_y = spec.y;
+        }
+
+        // Render colours are premultiplied
+        const XRenderColor& c = outline_color->color;
+        XRenderColor premultiplied;
+        premultiplied.red = static_cast<unsigned short>(c.red * c.alpha / 0xffff);
+        premultiplied.green = static_cast<unsigned short>(c.green * c.alpha / 0xffff);
+        premultiplied.blue = static_cast<unsigned short>(c.blue * c.alpha / 0xffff);
+        premultiplied.alpha = c.alpha;
+        Picture source = XRenderCreateSolidFill(display, &premultiplied);
+
+        // The A8 mask format accumulates overlapping outlines before compositing once
+        XRenderCompositeText32(display, PictOpOver, source, XftDrawPicture(ctx->back_draw),
+                               XRenderFindStandardFormat(display, PictStandardA8), 0, 0, 0, 0,
+                               outline_elts.data(), static_cast<int>(outline_elts.size()));
+        XRenderFreePicture(display, source);
+
+        XftDrawGlyphFontSpec(ctx->back_draw, fg, glyph_scratch.data(), static_cast<int>(glyph_scratch.size()));
+    }
+
+    // The ARGB visual and its colormap are shared by every overlay and live
+    // until shutdown, like the colours allocated in them
+    bool matchArgbVisual(XVisualInfo& vinfo)
+    {
+        if (!XMatchVisualInfo(display, DefaultScreen(display), 32, TrueColor, &vinfo))
+        {
+            std::cerr << "No 32-bit TrueColor visual available\n";
+            return false;
+        }
+        if (!colormap)
+        {
+            visual = vinfo.visual;
+            colormap = XCreateColormap(display, DefaultRootWindow(display), vinfo.visual, AllocNone);
+        }
+        return true;
+    }
+
+    void createOverlayWindow()
+    {
+        XVisualInfo vinfo;
+        if (!matchArgbVisual(vinfo))
+            return;
+
+        XSetWindowAttributes attr{};
+        attr.background_pixmap = None;
+        attr.background_pixel = rgba_to_pixel(0, 0, 0, 0);
+        attr.border_pixel = 0;
+        attr.win_gravity = NorthWestGravity;
+        attr.bit_gravity = ForgetGravity;
+        attr.save_under = 1;
+        attr.event_mask = BASIC_EVENT_MASK;
+        attr.do_not_propagate_mask = NOT_PROPAGATE_MASK;
+        attr.override_redirect = 1;
+        attr.colormap = colormap;
+        attr.backing_store = Always;
 
-        XShapeCombineMask(display, overlay_window, ShapeInput, 0, 0, None, ShapeSet);
-        allowInputPassthrough(overlay_window);
-        XMapWindow(display, overlay_window);
+        unsigned long mask = CWColormap | CWBorderPixel | CWBackPixel | CWEventMask |
+                             CWWinGravity | CWBitGravity | CWSaveUnder | CWDontPropagate |
+                             CWOverrideRedirect | CWBackingStore;
+
+        ctx->overlay_window = XCreateWindow(display, DefaultRootWindow(display),
+                                            ctx->pos_x, ctx->pos_y, ctx->width, ctx->height, 0,
+                                            vinfo.depth, InputOutput, vinfo.visual, mask, &attr);
+
+        ctx->back_buffer = XCreatePixmap(display, ctx->overlay_window, ctx->width, ctx->height, vinfo.depth);
+
+        XShapeCombineMask(display, ctx->overlay_window, ShapeInput, 0, 0, None, ShapeSet);
+        allowInputPassthrough(ctx->overlay_window);
+        XMapWindow(display, ctx->overlay_window);
 
-        back_draw = XftDrawCreate(display, back_buffer, visual, colormap);
-        gc = XCreateGC(display, back_buffer, 0, 0);
+        ctx->back_draw = XftDrawCreate(display, ctx->back_buffer, visual, colormap);
+        ctx->gc = XCreateGC(display, ctx->back_buffer, 0, 0);
+        ctx->full_damage = true;
     }
 
     bool checkTargetWindowExists()
     {
-        if (!display || !target_window)
+        if (!display || !ctx->target_window)
             return false;
 
         // Reset error flag
@@ -596,7 +1171,8 @@ namespace
         
         // Check if the target window still exists
         XWindowAttributes attr;
-        if (!XGetWindowAttributes(display, target_window, &attr))
+        FrameStats::countRoundTrip();
+        if (!XGetWindowAttributes(display, ctx->target_window, &attr))
         {
             // If we get here and x_error_occurred is true, it means we got a BadWindow error
             return false;
@@ -606,111 +1182,982 @@ namespace
         if (x_error_occurred) {
             return false;
         }
-        
-        return true;
+        
+        return true;
+    }
+
+    bool isTrackedWindow(const OverlayContext& c, Window w)
+    {
+        return std::find(c.tracked_windows.begin(), c.tracked_windows.end(), w) != c.tracked_windows.end();
+    }
+
+    bool trackedByOtherContext(Window w)
+    {
+        for (auto& entry : contexts)
+        {
+            if (&entry.second != ctx && isTrackedWindow(entry.second, w))
+                return true;
+        }
+        return false;
+    }
+
+    void unselectTrackedWindows()
+    {
+        for (Window w : ctx->tracked_windows)
+        {
+            // A destroyed target takes its selection with it, its frame and
+            // ancestors may live on. Overlays on sibling targets can share those.
+            if ((ctx->target_destroyed && w == ctx->target_window) || trackedByOtherContext(w))
+                continue;
+            XSelectInput(display, w, NoEventMask);
+        }
+        ctx->tracked_windows.clear();
+    }
+
+    void selectTrackedWindows()
+    {
+        unselectTrackedWindows();
+
+        // Watch the target and every ancestor up to (not including) root, since a
+        // reparenting window manager moves the frame rather than the client window
+        Window root = DefaultRootWindow(display);
+        Window w = ctx->target_window;
+        while (w && w != root)
+        {
+            XSelectInput(display, w, StructureNotifyMask);
+            ctx->tracked_windows.push_back(w);
+
+            Window root_return, parent_return;
+            Window* children = nullptr;
+            unsigned int nchildren = 0;
+            FrameStats::countRoundTrip();
+            if (!XQueryTree(display, w, &root_return, &parent_return, &children, &nchildren))
+                break;
+            if (children)
+                XFree(children);
+            w = parent_return;
+        }
+
+        ctx->ancestors_dirty = false;
+    }
+
+    bool isOverlayWindow(Window w)
+    {
+        for (auto& entry : contexts)
+        {
+            if (entry.second.overlay_window == w)
+                return true;
+        }
+        return false;
+    }
+
+    void dispatchEvent(OverlayContext& c, const XEvent& ev)
+    {
+        switch (ev.type)
+        {
+        case ConfigureNotify:
+            if (isTrackedWindow(c, ev.xconfigure.window))
+                c.geometry_dirty = true;
+            break;
+        case ReparentNotify:
+            if (isTrackedWindow(c, ev.xreparent.window))
+            {
+                c.ancestors_dirty = true;
+                c.geometry_dirty = true;
+            }
+            break;
+        case DestroyNotify:
+            if (ev.xdestroywindow.window == c.target_window)
+            {
+                c.target_destroyed = true;
+            }
+            else if (isTrackedWindow(c, ev.xdestroywindow.window))
+            {
+                // Gone, so never unselected
+                c.tracked_windows.erase(
+                    std::remove(c.tracked_windows.begin(), c.tracked_windows.end(), ev.xdestroywindow.window),
+                    c.tracked_windows.end());
+                c.ancestors_dirty = true;
+            }
+            break;
+        case PropertyNotify:
+            if (ev.xproperty.window == DefaultRootWindow(display) && ev.xproperty.atom == net_client_list)
+                c.discovery_dirty = true;
+            break;
+        case MapNotify:
+            // Only contexts still looking for their target collect candidates
+            if (discovery_watching && !c.overlay_initialized && !c.fixed_window &&
+                ev.xmap.event == DefaultRootWindow(display) && !isOverlayWindow(ev.xmap.window))
+                c.discovery_candidates.push_back(ev.xmap.window);
+            break;
+        case Expose:
+            if (ev.xexpose.window == c.overlay_window)
+            {
+                c.full_damage = true;
+                Overlay::markDirty();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void processPendingEvents()
+    {
+        // XPending only reads what the server already sent, it never waits for a reply.
+        // Whichever context drains the queue, every context sees every event.
+        while (XPending(display))
+        {
+            XEvent ev;
+            XNextEvent(display, &ev);
+            for (auto& entry : contexts)
+                dispatchEvent(entry.second, ev);
+        }
+    }
+
+    bool windowHasClass(Window w, const std::string& target_class)
+    {
+        XClassHint classHint;
+        if (!XGetClassHint(display, w, &classHint))
+            return false;
+
+        bool match = classHint.res_class && target_class == classHint.res_class;
+        if (classHint.res_name)
+            XFree(classHint.res_name);
+        if (classHint.res_class)
+            XFree(classHint.res_class);
+        return match;
+    }
+
+    bool readClientList(std::vector<Window>& clients)
+    {
+        Atom type;
+        int format;
+        unsigned long count, bytes_after;
+        unsigned char* data = nullptr;
+        if (XGetWindowProperty(display, DefaultRootWindow(display), net_client_list, 0, 65536, False, XA_WINDOW,
+                               &type, &format, &count, &bytes_after, &data) != Success)
+            return false;
+
+        bool ok = type == XA_WINDOW && format == 32;
+        if (ok)
+        {
+            Window* windows = reinterpret_cast<Window*>(data);
+            clients.assign(windows, windows + count);
+        }
+        if (data)
+            XFree(data);
+        return ok;
+    }
+
+    void startDiscoveryWatch()
+    {
+        if (discovery_watching)
+            return;
+
+        XSelectInput(display, DefaultRootWindow(display), PropertyChangeMask | SubstructureNotifyMask);
+        net_client_list = XInternAtom(display, "_NET_CLIENT_LIST", False);
+        discovery_watching = true;
+        for (auto& entry : contexts)
+        {
+            entry.second.discovery_dirty = true;
+            // Without a client list, windows mapped while we were not watching
+            // can only be found by walking the tree again
+            if (!have_client_list)
+                entry.second.discovery_walked = false;
+        }
+    }
+
+    void stopDiscoveryWatch()
+    {
+        ctx->discovery_candidates.clear();
+        if (!discovery_watching)
+            return;
+
+        // The root selection is shared, keep it while another context is searching
+        for (auto& entry : contexts)
+        {
+            const OverlayContext& c = entry.second;
+            if (&c != ctx && !c.overlay_initialized && !c.fixed_window && !c.current_window_class.empty())
+                return;
+        }
+
+        XSelectInput(display, DefaultRootWindow(display), NoEventMask);
+        discovery_watching = false;
+    }
+
+    bool findTargetWindow(const std::string& target_class, Window& outWin)
+    {
+        if (target_class != ctx->discovery_class)
+        {
+            ctx->discovery_class = target_class;
+            ctx->discovery_checked.clear();
+            ctx->discovery_dirty = true;
+            ctx->discovery_walked = false;
+            ctx->discovery_reported = false;
+        }
+
+        startDiscoveryWatch();
+        processPendingEvents();
+
+        // Newly mapped top-level windows
+        std::vector<Window> candidates;
+        candidates.swap(ctx->discovery_candidates);
+        for (Window w : candidates)
+        {
+            if (windowHasClass(w, target_class))
+            {
+                outWin = w;
+                return true;
+            }
+        }
+
+        // Nothing changed since the last scan, nothing to ask the server
+        if (!ctx->discovery_dirty)
+            return false;
+        ctx->discovery_dirty = false;
+
+        std::vector<Window> clients;
+        have_client_list = readClientList(clients);
+        if (have_client_list)
+        {
+            std::unordered_set<Window> present;
+            for (Window w : clients)
+            {
+                if (!ctx->discovery_checked.count(w) && windowHasClass(w, target_class))
+                {
+                    outWin = w;
+                    return true;
+                }
+                present.insert(w);
+            }
+            ctx->discovery_checked.swap(present); // Forget windows that went away
+        }
+
+        // One full walk per class catches targets outside the client list,
+        // e.g. embedded or override-redirect windows, or no EWMH at all
+        if (!ctx->discovery_walked)
+        {
+            ctx->discovery_walked = true;
+            return findWindowByClass(DefaultRootWindow(display), target_class, outWin);
+        }
+        return false;
+    }
+
+    bool openDisplay()
+    {
+        if (display)
+            return true;
+
+        // Set up X error handler before opening display
+        XSetErrorHandler(xErrorHandler);
+        
+        display = XOpenDisplay(0);
+        if (!display)
+        {
+            std::cerr << "Failed to open X display" << std::endl;
+            return false;
+        }
+        screen = DefaultScreen(display);
+        return true;
+    }
+
+    bool createHeadlessBuffer()
+    {
+        XVisualInfo vinfo;
+        if (!matchArgbVisual(vinfo))
+            return false;
+
+        ctx->back_buffer = XCreatePixmap(display, DefaultRootWindow(display), ctx->width, ctx->height, vinfo.depth);
+        ctx->back_draw = XftDrawCreate(display, ctx->back_buffer, visual, colormap);
+        ctx->gc = XCreateGC(display, ctx->back_buffer, 0, 0);
+        ctx->full_damage = true;
+        return true;
+    }
+
+    bool writeArgbPng(const char* path, const std::vector<unsigned int>& pixels, int w, int h)
+    {
+        FILE* file = fopen(path, "wb");
+        if (!file)
+            return false;
+
+        // Declared before setjmp so a libpng error does not jump past its lifetime
+        std::vector<png_byte> row(w * 4);
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        png_infop info = png ? png_create_info_struct(png) : nullptr;
+        if (!info || setjmp(png_jmpbuf(png)))
+        {
+            png_destroy_write_struct(&png, &info);
+            fclose(file);
+            return false;
+        }
+
+        png_init_io(png, file);
+        png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                     PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+
+        // PNG wants straight alpha
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                unsigned int p = pixels[y * w + x];
+                unsigned int a = p >> 24;
+                png_byte* out = &row[x * 4];
+                for (int c = 0; c < 3; c++)
+                {
+                    unsigned int v = (p >> (16 - 8 * c)) & 0xff;
+                    out[c] = static_cast<png_byte>(a ? std::min(255u, (v * 255 + a / 2) / a) : 0);
+                }
+                out[3] = static_cast<png_byte>(a);
+            }
+            png_write_row(png, row.data());
+        }
+
+        png_write_end(png, nullptr);
+        png_destroy_write_struct(&png, &info);
+        return fclose(file) == 0;
+    }
+
+    bool initializeOverlayInternal(const char* window_class)
+    {
+        if (!openDisplay())
+            return false;
+
+        Window found_window = ctx->fixed_window;
+        if (!found_window && !findTargetWindow(window_class ? std::string(window_class) : std::string(), found_window))
+        {
+            if (!ctx->discovery_reported)
+            {
+                std::cout << "Target window with class '" << (window_class ? window_class : "")
+                          << "' not found, waiting for it to appear..." << std::endl;
+                ctx->discovery_reported = true;
+            }
+            return false;
+        }
+
+        ctx->target_window = found_window;
+        stopDiscoveryWatch();
+        ctx->discovery_reported = false;
+        if (!getWindowGeometry(ctx->target_window)) {
+            std::cerr << "Failed to get window geometry" << std::endl;
+            return false;
+        }
+
+        // Fonts already matched are opened before the overlay is mapped, not by its first frames
+        warmPreloadedFonts(true);
+        createOverlayWindow();
+
+        ctx->target_destroyed = false;
+        if (tracking_mode == Overlay::TRACK_EVENTS)
+            selectTrackedWindows();
+        // A move between reading the geometry and selecting its events sent no
+        // ConfigureNotify to us, so read it once more on the next update
+        ctx->geometry_dirty = true;
+
+        ctx->overlay_initialized = true;
+        Overlay::markDirty();
+        if (ctx->fixed_window)
+            std::cout << "Overlay initialized successfully for window 0x" << std::hex << ctx->fixed_window << std::dec
+                      << std::endl;
+        else
+            std::cout << "Overlay initialized successfully for window class: " << window_class << std::endl;
+        return true;
+    }
+
+    void cleanupOverlayInternal()
+    {
+        if (ctx->back_draw)
+        {
+            XftDrawDestroy(ctx->back_draw);
+            ctx->back_draw = nullptr;
+        }
+        if (ctx->back_buffer)
+        {
+            XFreePixmap(display, ctx->back_buffer);
+            ctx->back_buffer = 0;
+        }
+        if (ctx->gc)
+        {
+            XFreeGC(display, ctx->gc);
+            ctx->gc = nullptr;
+        }
+
+        if (ctx->overlay_window)
+        {
+            XDestroyWindow(display, ctx->overlay_window);
+            ctx->overlay_window = 0;
+        }
+        unselectTrackedWindows();
+        ctx->frame_commands.clear();
+        ctx->previous_commands.clear();
+
+        ctx->target_window = 0;
+        ctx->overlay_initialized = false;
+        ctx->headless = false;
+        
+        std::cout << "Overlay cleaned up" << std::endl;
+    }
+
+    // Fonts, glyphs and colours outlive any one overlay and go with the display
+    void releaseSharedResources()
+    {
+        for (FontSet& font_set : font_sets)
+        {
+            if (font_set.primary)
+                XftFontClose(display, font_set.primary);
+        }
+        font_set_index.clear();
+        font_sets.clear();
+        freeFallbackFonts();
+        clearTextMetrics(); // Glyphs point into the fonts just closed
+        freeOutlineGlyphSets();
+        clearLabelCache();
+        if (label_gc)
+        {
+            XFreeGC(display, label_gc);
+            label_gc = nullptr;
+        }
+
+        freeColorCache();
+        if (colormap)
+        {
+            XFreeColormap(display, colormap);
+            colormap = 0;
+        }
+        visual = nullptr;
+    }
+
+    void renderStringPlain(const std::string& text, int x, int y,
+                           double r, double g, double b,
+                           const char* font_family, int font_size,
+                           Draw::TextAlignment alignment)
+    {
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
+
+        FontSet* font_set = getFontSet(font_family, font_size);
+        const TextMetrics& tm = computeTextMetrics(text, font_set);
+        XftColor color = getXftColor(r, g, b);
+
+        int baseline = y + font_set->line_ascent;
+        drawGlyphs(tm, x, baseline, &color, alignment);
+    }
+
+    void renderStringOutline(const std::string& text, int x, int y,
+                             double r, double g, double b,
+                             double outline_r, double outline_g, double outline_b, double outline_a,
+                             double outline_width,
+                             const char* font_family, int font_size,
+                             Draw::TextAlignment alignment)
+    {
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
+
+        FontSet* font_set = getFontSet(font_family, font_size);
+        const TextMetrics& tm = computeTextMetrics(text, font_set);
+        XftColor fg = getXftColor(r, g, b);
+        XftColor outline = getXftColor(outline_r, outline_g, outline_b, outline_a);
+
+        int baseline = y + font_set->line_ascent;
+        drawGlyphsOutline(tm, x, baseline, &fg, &outline, alignment, outline_width);
+    }
+
+    // Render colours are premultiplied
+    XRenderColor premultipliedColor(double r, double g, double b, double a)
+    {
+        a = std::min(std::max(a, 0.0), 1.0);
+        XRenderColor color;
+        color.red = static_cast<unsigned short>(std::min(std::max(r, 0.0), 1.0) * a * 0xffff + 0.5);
+        color.green = static_cast<unsigned short>(std::min(std::max(g, 0.0), 1.0) * a * 0xffff + 0.5);
+        color.blue = static_cast<unsigned short>(std::min(std::max(b, 0.0), 1.0) * a * 0xffff + 0.5);
+        color.alpha = static_cast<unsigned short>(a * 0xffff + 0.5);
+        return color;
+    }
+
+    XRectangle backgroundRect(const TextMetrics& tm, int x, int y, int padding, Draw::TextAlignment alignment)
+    {
+        int rect_width = tm.width + 2 * padding;
+        int rect_height = tm.height + 2 * padding;
+
+        // Adjust background position based on alignment
+        int bg_x = x - padding;
+        if (alignment == Draw::ALIGN_CENTER)
+            bg_x = x - rect_width / 2;
+        else if (alignment == Draw::ALIGN_RIGHT)
+            bg_x = x - rect_width + padding;
+
+        XRectangle rect;
+        rect.x = static_cast<short>(bg_x);
+        rect.y = static_cast<short>(y - padding);
+        rect.width = static_cast<unsigned short>(std::max(rect_width, 0));
+        rect.height = static_cast<unsigned short>(std::max(rect_height, 0));
+        return rect;
+    }
+
+    // Background rectangles of a frame's labels, one XRenderFillRectangles per colour
+    struct BackgroundBatch
+    {
+        XRenderColor color;
+        std::vector<XRectangle> rects;
+    };
+
+    std::vector<BackgroundBatch> background_batches;
+
+    void queueBackground(const XRenderColor& color, const XRectangle& rect)
+    {
+        if (!rect.width || !rect.height)
+            return;
+
+        for (BackgroundBatch& batch : background_batches)
+        {
+            if (batch.color.red == color.red && batch.color.green == color.green && batch.color.blue == color.blue &&
+                batch.color.alpha == color.alpha)
+            {
+                batch.rects.push_back(rect);
+                return;
+            }
+        }
+        background_batches.push_back(BackgroundBatch{color, std::vector<XRectangle>(1, rect)});
+    }
+
+    void flushBackgrounds()
+    {
+        for (const BackgroundBatch& batch : background_batches)
+            XRenderFillRectangles(display, PictOpOver, XftDrawPicture(ctx->back_draw), &batch.color,
+                                  batch.rects.data(), static_cast<int>(batch.rects.size()));
+        background_batches.clear();
+    }
+
+    // Only the text; backgrounds go through queueBackground
+    void renderCommandDirect(const DrawCommand& cmd)
+    {
+        const char* family = cmd.has_font_family ? cmd.font_family.c_str() : nullptr;
+        switch (cmd.type)
+        {
+        case CMD_PLAIN:
+        case CMD_BACKGROUND:
+            renderStringPlain(cmd.text, cmd.x, cmd.y, cmd.r, cmd.g, cmd.b, family, cmd.font_size, cmd.alignment);
+            break;
+        case CMD_OUTLINE:
+            renderStringOutline(cmd.text, cmd.x, cmd.y, cmd.r, cmd.g, cmd.b,
+                                cmd.extra_r, cmd.extra_g, cmd.extra_b, cmd.extra_a, cmd.outline_width,
+                                family, cmd.font_size, cmd.alignment);
+            break;
+        }
+    }
+
+    // Pixels a command can touch, before clamping to the overlay
+    void commandExtents(const DrawCommand& cmd, int& x0, int& y0, int& x1, int& y1)
+    {
+        FontSet* font_set = getFontSet(cmd.has_font_family ? cmd.font_family.c_str() : nullptr, cmd.font_size);
+        const TextMetrics& tm = computeTextMetrics(cmd.text, font_set);
+
+        x0 = cmd.x;
+        if (cmd.alignment == Draw::ALIGN_CENTER)
+            x0 = cmd.x - tm.width / 2;
+        else if (cmd.alignment == Draw::ALIGN_RIGHT)
+            x0 = cmd.x - tm.width;
+        y0 = cmd.y;
+        x1 = x0 + tm.width;
+        y1 = y0 + tm.height;
+
+        int grow = DAMAGE_MARGIN;
+        if (cmd.type == CMD_OUTLINE)
+            grow += static_cast<int>(std::ceil(std::max(1.0, cmd.outline_width)));
+        else if (cmd.type == CMD_BACKGROUND)
+            grow += std::max(cmd.padding, 0);
+
+        x0 -= grow;
+        y0 -= grow;
+        x1 += grow;
+        y1 += grow;
+    }
+
+    // A background label's texture is its plain text, whatever the background.
+    // The font generation is part of it because fallbacks move the baseline.
+    std::string labelKey(const DrawCommand& cmd)
+    {
+        bool outline = cmd.type == CMD_OUTLINE;
+        FontSet* font_set = getFontSet(cmd.has_font_family ? cmd.font_family.c_str() : nullptr, cmd.font_size);
+        computeTextMetrics(cmd.text, font_set);
+        const double values[] = {static_cast<double>(font_set->generation), outline ? 1.0 : 0.0,
+                                 cmd.r, cmd.g, cmd.b, outline ? cmd.extra_r : 0.0, outline ? cmd.extra_g : 0.0,
+                                 outline ? cmd.extra_b : 0.0, outline ? cmd.extra_a : 0.0,
+                                 outline ? cmd.outline_width : 0.0,
+                                 static_cast<double>(cmd.font_size), static_cast<double>(cmd.alignment),
+                                 static_cast<double>(cmd.has_font_family)};
+        std::string key(reinterpret_cast<const char*>(values), sizeof(values));
+        key += cmd.font_family;
+        key += '\x1f';
+        key += cmd.text;
+        return key;
+    }
+
+    bool createLabelTexture(LabelTexture& texture, const DrawCommand& cmd)
+    {
+        // The text alone, so the padding does not grow the pixmap
+        DrawCommand local = cmd;
+        if (local.type == CMD_BACKGROUND)
+            local.type = CMD_PLAIN;
+
+        int x0, y0, x1, y1;
+        commandExtents(local, x0, y0, x1, y1);
+        int width = x1 - x0;
+        int height = y1 - y0;
+        if (width <= 0 || height <= 0)
+            return false;
+
+        texture.pixmap = XCreatePixmap(display, ctx->back_buffer, width, height, 32);
+        texture.draw = XftDrawCreate(display, texture.pixmap, visual, colormap);
+        if (!label_gc)
+            label_gc = XCreateGC(display, texture.pixmap, 0, nullptr);
+        XRenderColor clear = premultipliedColor(0, 0, 0, 0);
+        XRenderFillRectangle(display, PictOpSrc, XftDrawPicture(texture.draw), &clear, 0, 0, width, height);
+
+        // The usual render path, pointed at the pixmap for the duration
+        Pixmap back_buffer = ctx->back_buffer;
+        XftDraw* back_draw = ctx->back_draw;
+        GC gc = ctx->gc;
+        ctx->back_buffer = texture.pixmap;
+        ctx->back_draw = texture.draw;
+        ctx->gc = label_gc;
+
+        local.x -= x0;
+        local.y -= y0;
+        renderCommandDirect(local);
+
+        ctx->back_buffer = back_buffer;
+        ctx->back_draw = back_draw;
+        ctx->gc = gc;
+
+        texture.origin_x = x0 - cmd.x;
+        texture.origin_y = y0 - cmd.y;
+        texture.width = width;
+        texture.height = height;
+        unsigned long pixel_bytes = static_cast<unsigned long>(width) * height * 4;
+        texture.bytes += pixel_bytes;
+        label_cache_bytes += pixel_bytes;
+        return true;
+    }
+
+    // Nothing is evicted here, the textures of a batch stay valid until
+    // renderCommands is done
+    LabelTexture* acquireLabelTexture(const DrawCommand& cmd)
+    {
+        if (!label_cache_budget)
+            return nullptr;
+
+        std::string key = labelKey(cmd);
+        auto it = label_cache_index.find(key);
+        if (it == label_cache_index.end())
+        {
+            label_cache_misses++;
+            if (!labelSeenBefore(key))
+                return nullptr;
+
+            LabelTexture texture;
+            texture.key = key;
+            texture.bytes = key.size();
+            label_cache_bytes += texture.bytes;
+            label_cache.push_front(texture);
+            label_cache_index[key] = label_cache.begin();
+            return createLabelTexture(label_cache.front(), cmd) ? &label_cache.front() : nullptr;
+        }
+
+        label_cache.splice(label_cache.begin(), label_cache, it->second);
+        LabelTexture& texture = label_cache.front();
+        if (texture.pixmap)
+        {
+            label_cache_hits++;
+            return &texture;
+        }
+
+        label_cache_misses++;
+        return createLabelTexture(texture, cmd) ? &texture : nullptr;
+    }
+
+    // Backgrounds of every label first, batched per colour, then the text on
+    // top. Textures hold only the text, so the order is the same whether a
+    // label is cached or not.
+    void renderCommands(const std::vector<const DrawCommand*>& commands)
+    {
+        if (!ctx->overlay_initialized || !ctx->back_draw || commands.empty())
+            return;
+
+        std::vector<LabelTexture*> textures(commands.size(), nullptr);
+        {
+            FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_BACKGROUND);
+            for (size_t i = 0; i < commands.size(); i++)
+            {
+                const DrawCommand& cmd = *commands[i];
+                textures[i] = acquireLabelTexture(cmd);
+                if (cmd.type != CMD_BACKGROUND)
+                    continue;
+
+                FontSet* font_set = getFontSet(cmd.has_font_family ? cmd.font_family.c_str() : nullptr,
+                                               cmd.font_size);
+                const TextMetrics& tm = computeTextMetrics(cmd.text, font_set);
+                queueBackground(premultipliedColor(cmd.extra_r, cmd.extra_g, cmd.extra_b, cmd.extra_a),
+                                backgroundRect(tm, cmd.x, cmd.y, cmd.padding, cmd.alignment));
+            }
+            flushBackgrounds();
+        }
+
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            const DrawCommand& cmd = *commands[i];
+            Overlay::FrameMetric metric = Overlay::METRIC_DRAW_PLAIN;
+            if (cmd.type == CMD_OUTLINE)
+                metric = Overlay::METRIC_DRAW_OUTLINE;
+            else if (cmd.type == CMD_BACKGROUND)
+                metric = Overlay::METRIC_DRAW_BACKGROUND;
+            FrameStats::ScopedPhase phase(metric);
+
+            const LabelTexture* texture = textures[i];
+            if (texture)
+            {
+                // Goes through the back buffer's picture, so a damage clip still applies
+                XRenderComposite(display, PictOpOver, XftDrawPicture(texture->draw), None,
+                                 XftDrawPicture(ctx->back_draw), 0, 0, 0, 0, cmd.x + texture->origin_x,
+                                 cmd.y + texture->origin_y, texture->width, texture->height);
+            }
+            else
+            {
+                renderCommandDirect(cmd);
+            }
+        }
+        evictLabels(label_cache_budget);
+    }
+
+    XRectangle clampRect(int x0, int y0, int x1, int y1)
+    {
+        XRectangle rect{};
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, ctx->width);
+        y1 = std::min(y1, ctx->height);
+        if (x1 > x0 && y1 > y0)
+        {
+            rect.x = static_cast<short>(x0);
+            rect.y = static_cast<short>(y0);
+            rect.width = static_cast<unsigned short>(x1 - x0);
+            rect.height = static_cast<unsigned short>(y1 - y0);
+        }
+        return rect;
+    }
+
+    XRectangle commandBounds(const DrawCommand& cmd)
+    {
+        int x0, y0, x1, y1;
+        commandExtents(cmd, x0, y0, x1, y1);
+        return clampRect(x0, y0, x1, y1);
+    }
+
+    // Recorded for endFrame, which batches the backgrounds; bounds are only
+    // needed to diff against the previous frame
+    void submitCommand(DrawCommand& cmd, const char* font_family)
+    {
+        if (font_family)
+        {
+            cmd.font_family = font_family;
+            cmd.has_font_family = true;
+        }
+        if (damage_tracking)
+        {
+            cmd.bounds = commandBounds(cmd);
+            // Read after measuring, which can bump it
+            cmd.generation = getFontSet(font_family, cmd.font_size)->generation;
+        }
+        ctx->frame_commands.push_back(std::move(cmd));
+    }
+
+    long long rectUnionArea(const std::vector<XRectangle>& rects)
+    {
+        // Sweep over x slabs, merging covered y spans in each
+        std::vector<int> xs;
+        for (const XRectangle& r : rects)
+        {
+            xs.push_back(r.x);
+            xs.push_back(r.x + r.width);
+        }
+        std::sort(xs.begin(), xs.end());
+        xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+
+        long long area = 0;
+        std::vector<std::pair<int, int>> spans;
+        for (size_t i = 0; i + 1 < xs.size(); ++i)
+        {
+            spans.clear();
+            for (const XRectangle& r : rects)
+                if (r.x <= xs[i] && r.x + r.width >= xs[i + 1])
+                    spans.push_back({r.y, r.y + r.height});
+            std::sort(spans.begin(), spans.end());
+
+            int covered = 0;
+            int run_start = 0, run_end = -1;
+            for (auto& sp : spans)
+            {
+                if (sp.first > run_end)
+                {
+                    covered += std::max(run_end - run_start, 0);
+                    run_start = sp.first;
+                    run_end = sp.second;
+                }
+                else
+                {
+                    run_end = std::max(run_end, sp.second);
+                }
+            }
+            covered += std::max(run_end - run_start, 0);
+            area += (long long)(xs[i + 1] - xs[i]) * covered;
+        }
+        return area;
     }
 
-    bool initializeOverlayInternal(const char* window_class)
+    void collectDamage(std::vector<XRectangle>& damage)
     {
-        if (!display)
+        if (ctx->full_damage)
+        {
+            damage.push_back(clampRect(0, 0, ctx->width, ctx->height));
+            return;
+        }
+
+        // Pair up commands that are identical to last frame, usually in the same order
+        std::vector<bool> matched_prev(ctx->previous_commands.size(), false);
+        for (size_t i = 0; i < ctx->frame_commands.size(); ++i)
         {
-            // Set up X error handler before opening display
-            XSetErrorHandler(xErrorHandler);
-            
-            display = XOpenDisplay(0);
-            if (!display)
+            const DrawCommand& cmd = ctx->frame_commands[i];
+            bool matched = false;
+            if (i < ctx->previous_commands.size() && !matched_prev[i] && ctx->previous_commands[i] == cmd)
             {
-                std::cerr << "Failed to open X display" << std::endl;
-                return false;
+                matched_prev[i] = true;
+                matched = true;
+            }
+            for (size_t j = 0; !matched && j < ctx->previous_commands.size(); ++j)
+            {
+                if (!matched_prev[j] && ctx->previous_commands[j] == cmd)
+                {
+                    matched_prev[j] = true;
+                    matched = true;
+                }
             }
-            screen = DefaultScreen(display);
+            if (!matched && cmd.bounds.width && cmd.bounds.height)
+                damage.push_back(cmd.bounds);
         }
-
-        Window found_window = 0;
-        if (!findWindowByClass(DefaultRootWindow(display), 
-                               window_class ? std::string(window_class) : std::string(), 
-                               found_window))
+        for (size_t j = 0; j < ctx->previous_commands.size(); ++j)
         {
-            std::cout << "Target window with class '" << (window_class ? window_class : "") 
-                      << "' not found, will retry..." << std::endl;
-            return false;
+            const XRectangle& b = ctx->previous_commands[j].bounds;
+            if (!matched_prev[j] && b.width && b.height)
+                damage.push_back(b);
         }
+    }
 
-        target_window = found_window;
-        if (!getWindowGeometry(target_window)) {
-            std::cerr << "Failed to get window geometry" << std::endl;
-            return false;
-        }
-        createOverlayWindow();
+    void presentDamage()
+    {
+        std::vector<XRectangle> damage;
+        collectDamage(damage);
+
+        ctx->damage_stats.frame_pixels = (long long)ctx->width * ctx->height;
+        ctx->damage_stats.damage_rects = static_cast<int>(damage.size());
+        ctx->damage_stats.damaged_pixels = damage.empty() ? 0 : rectUnionArea(damage);
 
-        // Initialize colors if not already done
-        if (!colors_initialized)
+        if (!damage.empty())
         {
-            xft_white = createXftColor(1.0, 1.0, 1.0, 1.0);
-            xft_black = createXftColor(0.0, 0.0, 0.0, 1.0);
-            xft_ltblue = createXftColor(0.0, 1.0, 1.0, 1.0);
-            xft_outline = createXftColor(0.0, 0.0, 0.0, 1.0);
-            colors_initialized = true;
+            Region region = XCreateRegion();
+            for (XRectangle& rect : damage)
+                XUnionRectWithRegion(&rect, region, region);
+
+            XRectangle box;
+            XClipBox(region, &box);
+            XSetRegion(display, ctx->gc, region);
+            XftDrawSetClip(ctx->back_draw, region);
+
+            {
+                FrameStats::ScopedPhase phase(Overlay::METRIC_CLEAR);
+                XSetForeground(display, ctx->gc, rgba_to_pixel(0, 0, 0, 0));
+                XFillRectangle(display, ctx->back_buffer, ctx->gc, box.x, box.y, box.width, box.height);
+            }
+
+            // Unchanged commands overlapping the damage must be repainted too
+            std::vector<const DrawCommand*> repaint;
+            for (const DrawCommand& cmd : ctx->frame_commands)
+            {
+                XRectangle b = cmd.bounds;
+                if (b.width && b.height &&
+                    XRectInRegion(region, b.x, b.y, b.width, b.height) != RectangleOut)
+                    repaint.push_back(&cmd);
+            }
+            renderCommands(repaint);
+
+            if (ctx->overlay_window)
+                XCopyArea(display, ctx->back_buffer, ctx->overlay_window, ctx->gc, box.x, box.y, box.width, box.height,
+                          box.x, box.y);
+
+            XSetClipMask(display, ctx->gc, None);
+            XftDrawSetClip(ctx->back_draw, nullptr);
+            XDestroyRegion(region);
         }
 
-        overlay_initialized = true;
-        std::cout << "Overlay initialized successfully for window class: " << window_class << std::endl;
-        return true;
+        ctx->full_damage = false;
+        ctx->previous_commands.swap(ctx->frame_commands);
+        ctx->frame_commands.clear();
     }
 
-    void cleanupOverlayInternal()
+    SceneElement* findElement(Draw::ElementHandle handle)
     {
-        if (back_draw)
-        {
-            XftDrawDestroy(back_draw);
-            back_draw = nullptr;
-        }
-        if (back_buffer)
-        {
-            XFreePixmap(display, back_buffer);
-            back_buffer = 0;
-        }
-        if (gc)
-        {
-            XFreeGC(display, gc);
-            gc = nullptr;
-        }
+        auto it = scene_elements.find(handle);
+        return it != scene_elements.end() ? &it->second : nullptr;
+    }
 
-        // Clean up font cache
-        for (auto& entry : font_cache)
-        {
-            if (entry.font_set.primary)
-                XftFontClose(display, entry.font_set.primary);
-            for (auto* f : entry.font_set.fallbacks)
-                if (f)
-                    XftFontClose(display, f);
-        }
-        font_cache.clear();
+    void touchElement(SceneElement& se)
+    {
+        se.revision++;
+        Overlay::markDirty();
+    }
 
-        if (colors_initialized)
+    DrawCommand commandFromElement(Draw::ElementHandle handle, const SceneElement& se)
+    {
+        const Draw::TextElement& e = se.element;
+
+        DrawCommand cmd;
+        cmd.text = e.text;
+        cmd.font_family = e.font_family;
+        cmd.has_font_family = !e.font_family.empty();
+        cmd.font_size = e.font_size;
+        cmd.x = e.x;
+        cmd.y = e.y;
+        cmd.r = e.r;
+        cmd.g = e.g;
+        cmd.b = e.b;
+        cmd.alignment = e.alignment;
+        cmd.element = handle;
+        cmd.revision = se.revision;
+
+        if (e.style == Draw::STYLE_OUTLINE)
         {
-            XftColorFree(display, visual, colormap, &xft_white);
-            XftColorFree(display, visual, colormap, &xft_black);
-            XftColorFree(display, visual, colormap, &xft_ltblue);
-            XftColorFree(display, visual, colormap, &xft_outline);
-            colors_initialized = false;
+            cmd.type = CMD_OUTLINE;
+            cmd.extra_r = e.outline_r;
+            cmd.extra_g = e.outline_g;
+            cmd.extra_b = e.outline_b;
+            cmd.extra_a = e.outline_a;
+            cmd.outline_width = e.outline_width;
         }
-
-        if (overlay_window)
+        else if (e.style == Draw::STYLE_BACKGROUND)
         {
-            XDestroyWindow(display, overlay_window);
-            overlay_window = 0;
+            cmd.type = CMD_BACKGROUND;
+            cmd.extra_r = e.bg_r;
+            cmd.extra_g = e.bg_g;
+            cmd.extra_b = e.bg_b;
+            cmd.extra_a = e.bg_a;
+            cmd.padding = e.padding;
         }
-        if (colormap)
+        else
         {
-            XFreeColormap(display, colormap);
-            colormap = 0;
+            cmd.type = CMD_PLAIN;
         }
-
-        target_window = 0;
-        overlay_initialized = false;
-        
-        std::cout << "Overlay cleaned up" << std::endl;
+        return cmd;
     }
 
 } // namespace
@@ -722,17 +2169,24 @@ namespace Draw
                          const char* font_family, int font_size,
                          TextAlignment alignment)
     {
-        if (!overlay_initialized || !back_draw)
+        if (RenderQueue::queuePlain(text, x, y, r, g, b, font_family, font_size, alignment))
             return;
 
-        FontSet* font_set = getFontSet(font_family, font_size);
-        TextMetrics tm = computeTextMetrics(text, font_set);
-        XftColor color = createXftColor(r, g, b, 1.0);
-
-        int baseline = y + font_set->line_ascent;
-        drawTextRuns(tm, x, baseline, &color, font_set, alignment);
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_PLAIN);
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
 
-        XftColorFree(display, visual, colormap, &color);
+        DrawCommand cmd;
+        cmd.type = CMD_PLAIN;
+        cmd.text = text;
+        cmd.font_size = font_size;
+        cmd.x = x;
+        cmd.y = y;
+        cmd.r = r;
+        cmd.g = g;
+        cmd.b = b;
+        cmd.alignment = alignment;
+        submitCommand(cmd, font_family);
     }
 
     void drawStringOutline(const std::string& text, int x, int y,
@@ -742,19 +2196,30 @@ namespace Draw
                            const char* font_family, int font_size,
                            TextAlignment alignment)
     {
-        if (!overlay_initialized || !back_draw)
+        if (RenderQueue::queueOutline(text, x, y, r, g, b, outline_r, outline_g, outline_b, outline_a, outline_width,
+                                      font_family, font_size, alignment))
             return;
 
-        FontSet* font_set = getFontSet(font_family, font_size);
-        TextMetrics tm = computeTextMetrics(text, font_set);
-        XftColor fg = createXftColor(r, g, b, 1.0);
-        XftColor outline = createXftColor(outline_r, outline_g, outline_b, outline_a);
-
-        int baseline = y + font_set->line_ascent;
-        drawTextRunsOutline(tm, x, baseline, &fg, &outline, font_set, alignment, (int)std::max(1.0, outline_width));
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_OUTLINE);
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
 
-        XftColorFree(display, visual, colormap, &fg);
-        XftColorFree(display, visual, colormap, &outline);
+        DrawCommand cmd;
+        cmd.type = CMD_OUTLINE;
+        cmd.text = text;
+        cmd.font_size = font_size;
+        cmd.x = x;
+        cmd.y = y;
+        cmd.r = r;
+        cmd.g = g;
+        cmd.b = b;
+        cmd.extra_r = outline_r;
+        cmd.extra_g = outline_g;
+        cmd.extra_b = outline_b;
+        cmd.extra_a = outline_a;
+        cmd.outline_width = outline_width;
+        cmd.alignment = alignment;
+        submitCommand(cmd, font_family);
     }
 
     void drawStringBackground(const std::string& text, int x, int y,
@@ -764,58 +2229,154 @@ namespace Draw
                               const char* font_family, int font_size,
                               TextAlignment alignment)
     {
-        if (!overlay_initialized || !back_draw)
+        if (RenderQueue::queueBackground(text, x, y, r, g, b, bg_r, bg_g, bg_b, bg_a, padding, font_family, font_size,
+                                         alignment))
             return;
 
-        FontSet* font_set = getFontSet(font_family, font_size);
-        TextMetrics tm = computeTextMetrics(text, font_set);
-        XftColor fg = createXftColor(r, g, b, 1.0);
-
-        unsigned long bg_pixel = rgba_to_pixel(
-            (unsigned char)(bg_r * 255.0),
-            (unsigned char)(bg_g * 255.0),
-            (unsigned char)(bg_b * 255.0),
-            (unsigned char)(bg_a * 255.0));
-
-        int rect_width = tm.width + 2 * padding;
-        int rect_height = tm.height + 2 * padding;
-
-        // Adjust background position based on alignment
-        int bg_x = x - padding;
-        if (alignment == ALIGN_CENTER)
-            bg_x = x - rect_width / 2;
-        else if (alignment == ALIGN_RIGHT)
-            bg_x = x - rect_width + padding;
-
-        XSetForeground(display, gc, bg_pixel);
-        XFillRectangle(display, back_buffer, gc, bg_x, y - padding, rect_width, rect_height);
-
-        int baseline = y + font_set->line_ascent;
-        drawTextRuns(tm, x, baseline, &fg, font_set, alignment);
+        FrameStats::ScopedPhase phase(Overlay::METRIC_DRAW_BACKGROUND);
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
 
-        XftColorFree(display, visual, colormap, &fg);
+        DrawCommand cmd;
+        cmd.type = CMD_BACKGROUND;
+        cmd.text = text;
+        cmd.font_size = font_size;
+        cmd.x = x;
+        cmd.y = y;
+        cmd.r = r;
+        cmd.g = g;
+        cmd.b = b;
+        cmd.extra_r = bg_r;
+        cmd.extra_g = bg_g;
+        cmd.extra_b = bg_b;
+        cmd.extra_a = bg_a;
+        cmd.padding = padding;
+        cmd.alignment = alignment;
+        submitCommand(cmd, font_family);
     }
 
     void getTextSize(const std::string& text, int* width, int* height,
                      const char* font_family, int font_size)
     {
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return;
 
         FontSet* font_set = getFontSet(font_family, font_size);
-        TextMetrics tm = computeTextMetrics(text, font_set);
+        const TextMetrics& tm = computeTextMetrics(text, font_set);
         if (width)
             *width = tm.width;
         if (height)
             *height = tm.height;
     }
+    ElementHandle createTextElement(const TextElement& element)
+    {
+        ElementHandle handle = next_element_handle++;
+        scene_elements[handle].element = element;
+        Overlay::markDirty();
+        return handle;
+    }
+
+    void destroyTextElement(ElementHandle handle)
+    {
+        if (!scene_elements.erase(handle))
+            return;
+
+        for (auto& entry : contexts)
+            entry.second.element_bounds.erase(handle);
+        Overlay::markDirty();
+    }
+
+    void setElementText(ElementHandle handle, const std::string& text)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || se->element.text == text)
+            return;
+        se->element.text = text;
+        touchElement(*se);
+    }
+
+    void setElementPosition(ElementHandle handle, int x, int y)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || (se->element.x == x && se->element.y == y))
+            return;
+        se->element.x = x;
+        se->element.y = y;
+        touchElement(*se);
+    }
+
+    void setElementColor(ElementHandle handle, double r, double g, double b)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || (se->element.r == r && se->element.g == g && se->element.b == b))
+            return;
+        se->element.r = r;
+        se->element.g = g;
+        se->element.b = b;
+        touchElement(*se);
+    }
+
+    void setElementVisible(ElementHandle handle, bool visible)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se || se->element.visible == visible)
+            return;
+        se->element.visible = visible;
+        touchElement(*se);
+    }
+
+    void getElementSize(ElementHandle handle, int* width, int* height)
+    {
+        SceneElement* se = findElement(handle);
+        if (!se)
+            return;
+        const TextElement& e = se->element;
+        getTextSize(e.text, width, height, e.font_family.empty() ? nullptr : e.font_family.c_str(), e.font_size);
+    }
+
+    void drawElements()
+    {
+        if (!ctx->overlay_initialized || !ctx->back_draw)
+            return;
+
+        for (auto& entry : scene_elements)
+        {
+            SceneElement& se = entry.second;
+            if (!se.element.visible)
+                continue;
+
+            DrawCommand cmd = commandFromElement(entry.first, se);
+            if (!damage_tracking)
+            {
+                ctx->frame_commands.push_back(std::move(cmd));
+                continue;
+            }
+
+            const FontSet* font_set = getFontSet(cmd.has_font_family ? cmd.font_family.c_str() : nullptr,
+                                                 cmd.font_size);
+            ElementBounds& bounds = ctx->element_bounds[entry.first];
+            if (!bounds.valid || bounds.revision != se.revision || bounds.width != ctx->width ||
+                bounds.height != ctx->height || bounds.generation != font_set->generation)
+            {
+                bounds.rect = commandBounds(cmd);
+                bounds.revision = se.revision;
+                bounds.width = ctx->width;
+                bounds.height = ctx->height;
+                bounds.generation = font_set->generation; // Read after measuring, which can bump it
+                bounds.valid = true;
+            }
+            cmd.bounds = bounds.rect;
+            cmd.generation = bounds.generation;
+            ctx->frame_commands.push_back(std::move(cmd));
+        }
+    }
 } // namespace Draw
 
 namespace Overlay
 {
     bool isInitialized()
     {
-        return overlay_initialized;
+        return ctx->overlay_initialized;
     }
 
     void cleanup()
@@ -825,10 +2386,24 @@ namespace Overlay
 
     bool tryInitialize(const char* window_class)
     {
-        if (overlay_initialized)
+        if (ctx->headless)
+            return ctx->overlay_initialized;
+
+        if (ctx->overlay_initialized)
         {
             // Check if our current target window still exists
-            if (!checkTargetWindowExists())
+            bool target_alive;
+            if (tracking_mode == TRACK_EVENTS)
+            {
+                processPendingEvents();
+                target_alive = !ctx->target_destroyed;
+            }
+            else
+            {
+                target_alive = checkTargetWindowExists();
+            }
+
+            if (!target_alive)
             {
                 std::cout << "Target window lost, cleaning up overlay..." << std::endl;
                 cleanupOverlayInternal();
@@ -842,12 +2417,12 @@ namespace Overlay
         // Try to initialize with the new window class
         if (window_class)
         {
-            current_window_class = window_class;
+            ctx->current_window_class = window_class;
         }
 
-        if (!current_window_class.empty())
+        if (ctx->fixed_window || !ctx->current_window_class.empty())
         {
-            return initializeOverlayInternal(current_window_class.c_str());
+            return initializeOverlayInternal(ctx->current_window_class.c_str());
         }
 
         return false;
@@ -855,102 +2430,424 @@ namespace Overlay
 
     bool initialize(const char* window_class)
     {
-        current_window_class = window_class ? window_class : "";
+        ctx->current_window_class = window_class ? window_class : "";
         return tryInitialize(window_class);
     }
 
+    bool initializeHeadless(int w, int h)
+    {
+        if (ctx->overlay_initialized)
+            cleanupOverlayInternal();
+        if (w <= 0 || h <= 0 || !openDisplay())
+            return false;
+
+        ctx->pos_x = ctx->pos_y = 0;
+        ctx->width = w;
+        ctx->height = h;
+        if (!createHeadlessBuffer())
+            return false;
+
+        ctx->headless = true;
+        ctx->overlay_initialized = true;
+        Overlay::markDirty();
+        std::cout << "Overlay initialized headless at " << w << "x" << h << std::endl;
+        return true;
+    }
+
+    bool readPixels(std::vector<unsigned int>& pixels, int* w, int* h)
+    {
+        if (!ctx->overlay_initialized || !ctx->back_buffer)
+            return false;
+
+        FrameStats::countRoundTrip();
+        XImage* image = XGetImage(display, ctx->back_buffer, 0, 0, ctx->width, ctx->height, AllPlanes, ZPixmap);
+        if (!image)
+            return false;
+
+        // XGetPixel copes with whatever byte order the server picked
+        pixels.resize(static_cast<size_t>(ctx->width) * ctx->height);
+        for (int y = 0; y < ctx->height; y++)
+            for (int x = 0; x < ctx->width; x++)
+                pixels[static_cast<size_t>(y) * ctx->width + x] = static_cast<unsigned int>(XGetPixel(image, x, y));
+        XDestroyImage(image);
+
+        if (w)
+            *w = ctx->width;
+        if (h)
+            *h = ctx->height;
+        return true;
+    }
+
+    bool writePng(const char* path)
+    {
+        std::vector<unsigned int> pixels;
+        int w, h;
+        if (!path || !readPixels(pixels, &w, &h))
+            return false;
+        return writeArgbPng(path, pixels, w, h);
+    }
+
     void shutdown()
     {
-        cleanupOverlayInternal();
+        for (auto& entry : contexts)
+        {
+            ctx = &entry.second;
+            if (ctx->overlay_initialized)
+                cleanupOverlayInternal();
+        }
+        contexts.clear();
+        ctx = &contexts[DEFAULT_CONTEXT];
+
+        releaseSharedResources();
         if (display)
         {
             XCloseDisplay(display);
             display = nullptr;
         }
-        textMetricsCache.clear();
+        scene_elements.clear();
+        FontPreload::shutdown();
+        discovery_watching = false;
     }
 
     void beginFrame()
     {
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return;
 
-        XSetForeground(display, gc, rgba_to_pixel(0, 0, 0, 0));
-        XFillRectangle(display, back_buffer, gc, 0, 0, width, height);
+        if (!batching)
+            FrameStats::beginFrame();
+        warmPreloadedFonts(false); // Fonts that resolved after initialization
+        ctx->frame_commands.clear();
+        if (damage_tracking)
+            return; // Clearing is deferred to endFrame, where the damage is known
+
+        FrameStats::ScopedPhase phase(METRIC_CLEAR);
+        XSetForeground(display, ctx->gc, rgba_to_pixel(0, 0, 0, 0));
+        XFillRectangle(display, ctx->back_buffer, ctx->gc, 0, 0, ctx->width, ctx->height);
     }
 
     void endFrame()
     {
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return;
 
-        XCopyArea(display, back_buffer, overlay_window, gc, 0, 0, width, height, 0, 0);
-        XFlush(display);
+        {
+            FrameStats::ScopedPhase phase(METRIC_PRESENT);
+            if (damage_tracking)
+            {
+                presentDamage();
+            }
+            else
+            {
+                std::vector<const DrawCommand*> commands;
+                for (const DrawCommand& cmd : ctx->frame_commands)
+                    commands.push_back(&cmd);
+                renderCommands(commands);
+                ctx->frame_commands.clear();
+
+                if (ctx->overlay_window)
+                    XCopyArea(display, ctx->back_buffer, ctx->overlay_window, ctx->gc, 0, 0, ctx->width, ctx->height,
+                              0, 0);
+
+                ctx->damage_stats.frame_pixels = (long long)ctx->width * ctx->height;
+                ctx->damage_stats.damaged_pixels = ctx->damage_stats.frame_pixels;
+                ctx->damage_stats.damage_rects = 1;
+            }
+            if (!batching)
+                XFlush(display);
+        }
+        if (!batching)
+            FrameStats::endFrame(NextRequest(display));
     }
 
     void updateWindowPosition()
     {
-        if (!overlay_initialized || !target_window)
+        if (!ctx->overlay_initialized || !ctx->target_window)
             return;
 
-        // Check if target window still exists
-        if (!checkTargetWindowExists())
+        FrameStats::ScopedPhase phase(METRIC_GEOMETRY);
+        // Polling still gets Expose and discovery events, only geometry is asked for
+        processPendingEvents();
+        if (tracking_mode == TRACK_EVENTS)
+        {
+            if (ctx->target_destroyed)
+            {
+                std::cout << "Target window disappeared during update" << std::endl;
+                cleanupOverlayInternal();
+                return;
+            }
+            if (ctx->ancestors_dirty)
+                selectTrackedWindows();
+            // Steady state: nothing moved, nothing to ask the server
+            if (!ctx->geometry_dirty)
+                return;
+        }
+        else if (!checkTargetWindowExists())
         {
+            // Check if target window still exists
             std::cout << "Target window disappeared during update" << std::endl;
             cleanupOverlayInternal();
             return;
         }
 
+        int last_x = ctx->pos_x, last_y = ctx->pos_y;
+        int last_w = ctx->width, last_h = ctx->height;
+
         // Use the safe version of getWindowGeometry
-        if (!getWindowGeometry(target_window)) {
+        if (!getWindowGeometry(ctx->target_window)) {
             std::cout << "Failed to get window geometry, cleaning up overlay" << std::endl;
             cleanupOverlayInternal();
             return;
         }
-        
-        XMoveResizeWindow(display, overlay_window, pos_x, pos_y, width, height);
+        ctx->geometry_dirty = false;
+
+        if (ctx->pos_x == last_x && ctx->pos_y == last_y && ctx->width == last_w && ctx->height == last_h)
+            return;
 
-        static int last_w = 0, last_h = 0;
-        if (width != last_w || height != last_h)
+        XMoveResizeWindow(display, ctx->overlay_window, ctx->pos_x, ctx->pos_y, ctx->width, ctx->height);
+        markDirty();
+
+        if (ctx->width != last_w || ctx->height != last_h)
         {
-            if (back_draw)
+            if (ctx->back_draw)
             {
-                XftDrawDestroy(back_draw);
-                back_draw = nullptr;
+                XftDrawDestroy(ctx->back_draw);
+                ctx->back_draw = nullptr;
             }
-            if (back_buffer)
+            if (ctx->back_buffer)
             {
-                XFreePixmap(display, back_buffer);
-                back_buffer = 0;
+                XFreePixmap(display, ctx->back_buffer);
+                ctx->back_buffer = 0;
             }
-            if (gc)
+            if (ctx->gc)
             {
-                XFreeGC(display, gc);
-                gc = nullptr;
+                XFreeGC(display, ctx->gc);
+                ctx->gc = nullptr;
             }
 
             XVisualInfo vinfo;
             XMatchVisualInfo(display, screen, 32, TrueColor, &vinfo);
-            back_buffer = XCreatePixmap(display, overlay_window, width, height, vinfo.depth);
-            back_draw = XftDrawCreate(display, back_buffer, visual, colormap);
-            gc = XCreateGC(display, back_buffer, 0, 0);
+            ctx->back_buffer = XCreatePixmap(display, ctx->overlay_window, ctx->width, ctx->height, vinfo.depth);
+            ctx->back_draw = XftDrawCreate(display, ctx->back_buffer, visual, colormap);
+            ctx->gc = XCreateGC(display, ctx->back_buffer, 0, 0);
+            ctx->full_damage = true;
+        }
+    }
+
+    void setTrackingMode(TrackingMode mode)
+    {
+        if (mode == tracking_mode)
+            return;
+
+        tracking_mode = mode;
+        if (!ctx->overlay_initialized)
+            return;
+
+        if (mode == TRACK_EVENTS)
+        {
+            selectTrackedWindows();
+            ctx->geometry_dirty = true; // Anything may have moved while we weren't listening
+        }
+        else
+        {
+            unselectTrackedWindows();
+        }
+    }
+
+    int getConnectionNumber()
+    {
+        return display ? ConnectionNumber(display) : -1;
+    }
+
+    bool hasQueuedEvents()
+    {
+        return display && XEventsQueued(display, QueuedAlready) > 0;
+    }
+
+    void setDamageTracking(bool enabled)
+    {
+        if (enabled == damage_tracking)
+            return;
+
+        damage_tracking = enabled;
+        for (auto& entry : contexts)
+        {
+            entry.second.frame_commands.clear();
+            entry.second.previous_commands.clear();
+            entry.second.full_damage = true;
+        }
+    }
+
+    ContextHandle createContext(const char* window_class)
+    {
+        if (!window_class || !*window_class)
+            return INVALID_CONTEXT;
+
+        ContextHandle handle = next_context_handle++;
+        contexts[handle].current_window_class = window_class;
+        return handle;
+    }
+
+    ContextHandle createContextForWindow(unsigned long window_id)
+    {
+        if (!window_id)
+            return INVALID_CONTEXT;
+
+        ContextHandle handle = next_context_handle++;
+        contexts[handle].fixed_window = window_id;
+        return handle;
+    }
+
+    void destroyContext(ContextHandle context)
+    {
+        auto it = contexts.find(context);
+        if (context == DEFAULT_CONTEXT || it == contexts.end())
+            return;
+
+        OverlayContext* previous = ctx == &it->second ? &contexts[DEFAULT_CONTEXT] : ctx;
+        ctx = &it->second;
+        if (ctx->overlay_initialized)
+            cleanupOverlayInternal();
+        ctx = previous;
+        contexts.erase(it);
+    }
+
+    bool setCurrentContext(ContextHandle context)
+    {
+        auto it = contexts.find(context);
+        if (it == contexts.end())
+            return false;
+        ctx = &it->second;
+        return true;
+    }
+
+    ContextHandle getCurrentContext()
+    {
+        for (auto& entry : contexts)
+        {
+            if (&entry.second == ctx)
+                return entry.first;
+        }
+        return DEFAULT_CONTEXT;
+    }
+
+    std::vector<ContextHandle> getContexts()
+    {
+        std::vector<ContextHandle> handles;
+        for (auto& entry : contexts)
+            handles.push_back(entry.first);
+        return handles;
+    }
+
+    void renderContexts(const std::function<void(ContextHandle)>& draw)
+    {
+        OverlayContext* previous = ctx;
+        batching = true;
+        FrameStats::beginFrame(); // One frame for the whole pass, however many overlays it paints
+        for (auto& entry : contexts)
+        {
+            ctx = &entry.second;
+            if (!tryInitialize(nullptr))
+                continue;
+
+            updateWindowPosition();
+            if (!ctx->overlay_initialized)
+                continue;
+
+            beginFrame();
+            if (draw)
+                draw(entry.first);
+            endFrame();
+        }
+        batching = false;
+        ctx = previous;
+
+        // Every overlay's requests go out together
+        if (display)
+            XFlush(display);
+        FrameStats::endFrame(display ? NextRequest(display) : 0);
+    }
+
+    void setSharedMemoryPresent(bool enabled)
+    {
+        // Xft renders into a server-side pixmap, there is no image to upload
+        (void)enabled;
+    }
+
+    void setRasterThreads(int threads)
+    {
+        // Glyphs are composited by the X server, there is nothing to split
+        (void)threads;
+    }
+
+    DamageStats getDamageStats()
+    {
+        return ctx->damage_stats;
+    }
 
-            last_w = width;
-            last_h = height;
+    void preloadFonts(const std::vector<FontRequest>& fonts, const std::string& characters)
+    {
+        std::vector<FontPreload::Job> jobs;
+        for (const FontRequest& request : fonts)
+        {
+            FontPreload::Job job;
+            job.family = request.family.empty() ? "Consolas" : request.family;
+            job.size = compensatedFontSize(request.size);
+            job.characters = characters;
+            jobs.push_back(job);
         }
+        FontPreload::enqueue(jobs);
+    }
+
+    void setTextCacheCapacity(unsigned long entries)
+    {
+        text_metrics_capacity = entries;
+        evictTextMetrics(text_metrics_capacity);
+    }
+
+    TextCacheStats getTextCacheStats()
+    {
+        TextCacheStats stats;
+        stats.hits = text_metrics_hits;
+        stats.misses = text_metrics_misses;
+        stats.evictions = text_metrics_evictions;
+        stats.entries = text_metrics_lru.size();
+        stats.capacity = text_metrics_capacity;
+        return stats;
+    }
+
+    void setLabelCacheBudget(unsigned long bytes)
+    {
+        label_cache_budget = bytes;
+        if (!bytes)
+            clearLabelCache();
+        else
+            evictLabels(bytes);
+    }
+
+    LabelCacheStats getLabelCacheStats()
+    {
+        LabelCacheStats stats;
+        stats.hits = label_cache_hits;
+        stats.misses = label_cache_misses;
+        stats.evictions = label_cache_evictions;
+        stats.entries = label_cache.size();
+        stats.bytes = label_cache_bytes;
+        stats.budget = label_cache_budget;
+        return stats;
     }
 
     int getWidth() 
     { 
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return 0;
-        return width; 
+        return ctx->width; 
     }
     
     int getHeight() 
     { 
-        if (!overlay_initialized)
+        if (!ctx->overlay_initialized)
             return 0;
-        return height; 
+        return ctx->height; 
     }
 } // namespace Overlay
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "font_preload.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+    std::mutex preload_mutex;
+    std::deque<FontPreload::Job> pending_jobs;
+    std::deque<FontPreload::Job> resolved_jobs;
+    std::thread preload_thread;
+    bool worker_running = false;
+    bool stop_requested = false;
+
+    int requested_count = 0;
+    int resolved_count = 0;
+    int ready_count = 0;
+
+    // Same pattern the Xft backend builds, so its match can be used as is
+    FcPattern* matchFont(const std::string& family, int size)
+    {
+        FcPattern* pat = FcPatternCreate();
+        FcPatternAddString(pat, FC_FAMILY, (const FcChar8*)family.c_str());
+        FcPatternAddDouble(pat, FC_SIZE, size);
+        FcConfigSubstitute(nullptr, pat, FcMatchPattern);
+        FcDefaultSubstitute(pat);
+
+        FcResult result;
+        FcPattern* match = FcFontMatch(nullptr, pat, &result);
+        FcPatternDestroy(pat);
+        return match;
+    }
+
+    void readAhead(FcPattern* match)
+    {
+        FcChar8* file = nullptr;
+        if (FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
+            return;
+
+        int fd = open(reinterpret_cast<const char*>(file), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+
+    void preloadWorker()
+    {
+        std::unique_lock<std::mutex> lock(preload_mutex);
+        while (!stop_requested && !pending_jobs.empty())
+        {
+            FontPreload::Job job = pending_jobs.front();
+            pending_jobs.pop_front();
+
+            // fontconfig is the slow part and needs no lock of ours
+            lock.unlock();
+            job.match = matchFont(job.family, job.size);
+            if (job.match)
+                readAhead(job.match);
+            lock.lock();
+
+            resolved_jobs.push_back(job);
+            resolved_count++;
+        }
+        worker_running = false;
+    }
+} // namespace
+
+namespace FontPreload
+{
+    void enqueue(const std::vector<Job>& jobs)
+    {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        pending_jobs.insert(pending_jobs.end(), jobs.begin(), jobs.end());
+        requested_count += static_cast<int>(jobs.size());
+
+        if (!worker_running && !pending_jobs.empty())
+        {
+            // A finished worker has already let go of the lock for good
+            if (preload_thread.joinable())
+                preload_thread.join();
+            worker_running = true;
+            stop_requested = false;
+            preload_thread = std::thread(preloadWorker);
+        }
+    }
+
+    bool takeResolved(Job& job)
+    {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        if (resolved_jobs.empty())
+            return false;
+
+        job = resolved_jobs.front();
+        resolved_jobs.pop_front();
+        return true;
+    }
+
+    void markReady()
+    {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        ready_count++;
+    }
+
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(preload_mutex);
+            stop_requested = true;
+        }
+        if (preload_thread.joinable())
+            preload_thread.join();
+
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        for (Job& job : resolved_jobs)
+            if (job.match)
+                FcPatternDestroy(job.match);
+        resolved_jobs.clear();
+        pending_jobs.clear();
+        worker_running = false;
+    }
+} // namespace FontPreload
+
+namespace Overlay
+{
+    PreloadStatus getPreloadStatus()
+    {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        PreloadStatus status;
+        status.requested = requested_count;
+        status.resolved = resolved_count;
+        status.ready = ready_count;
+        return status;
+    }
+} // namespace Overlay
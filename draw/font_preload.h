@@ -0,0 +1,26 @@
+#pragma once
+#include "draw.h"
+#include <fontconfig/fontconfig.h>
+
+#include <string>
+#include <vector>
+
+// Background half of Overlay::preloadFonts, shared by both backends. A
+// worker thread runs the fontconfig match and starts reading the font file;
+// the render thread then takes resolved jobs and does the part that needs
+// the X connection or the backend's own font objects.
+namespace FontPreload
+{
+    struct Job
+    {
+        std::string family;         // Already defaulted the way the backend will ask for it
+        int size = 0;
+        std::string characters;     // Glyphs to rasterize once the font is open
+        FcPattern* match = nullptr; // FcFontMatch result, owned by whoever holds the job
+    };
+
+    void enqueue(const std::vector<Job>& jobs);
+    bool takeResolved(Job& job);
+    void markReady();
+    void shutdown(); // Drops unfinished jobs, the status counters keep counting
+} // namespace FontPreload
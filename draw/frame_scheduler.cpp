@@ -0,0 +1,182 @@
+#include "draw.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    double target_fps = 60.0;
+    double idle_fps = 4.0;
+
+    std::atomic<bool> content_dirty(true);
+    // Created by the render thread, read by markDirty from any thread
+    std::atomic<int> timer_fd(-1); // Absolute CLOCK_MONOTONIC deadlines
+    std::atomic<int> wake_fd(-1);  // Signalled by markDirty
+    Clock::time_point last_deadline;
+    bool have_deadline = false;
+
+    Clock::duration intervalFor(double fps)
+    {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+    }
+
+    bool ensureFds()
+    {
+        if (timer_fd < 0)
+            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (wake_fd < 0)
+            wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        return timer_fd >= 0 && wake_fd >= 0;
+    }
+
+    void drainFd(int fd)
+    {
+        uint64_t value;
+        ssize_t n = read(fd, &value, sizeof(value));
+        (void)n;
+    }
+
+    void armTimer(const Clock::time_point* deadline)
+    {
+        // steady_clock is CLOCK_MONOTONIC on Linux, so its epoch matches the timer's
+        itimerspec spec{};
+        if (deadline)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline->time_since_epoch()).count();
+            spec.it_value.tv_sec = ns / 1000000000;
+            spec.it_value.tv_nsec = ns % 1000000000;
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+                spec.it_value.tv_nsec = 1; // All zero would disarm
+        }
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    // Sleeps until the deadline (or forever when it is null). With
+    // wake_on_activity, X input and markDirty end the wait early.
+    // Returns true when woken early.
+    bool waitUntil(const Clock::time_point* deadline, bool wake_on_activity)
+    {
+        if (deadline && *deadline <= Clock::now())
+            return false;
+
+        // Xlib may already hold events it read while we were drawing; poll
+        // would not see them on the socket
+        if (wake_on_activity && Overlay::hasQueuedEvents())
+            return true;
+
+        if (!ensureFds())
+        {
+            // No timerfd/eventfd: fall back to plain absolute sleeps
+            if (deadline)
+                std::this_thread::sleep_until(*deadline);
+            else
+                std::this_thread::sleep_for(intervalFor(idle_fps > 0 ? idle_fps : 1.0));
+            return false;
+        }
+
+        armTimer(deadline);
+
+        pollfd fds[3];
+        int nfds = 0;
+        fds[nfds++] = {timer_fd, POLLIN, 0};
+        if (wake_on_activity)
+        {
+            fds[nfds++] = {wake_fd, POLLIN, 0};
+            int x_fd = Overlay::getConnectionNumber();
+            if (x_fd >= 0)
+                fds[nfds++] = {x_fd, POLLIN, 0};
+        }
+
+        while (poll(fds, nfds, -1) < 0 && errno == EINTR)
+        {
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            drainFd(timer_fd);
+            return false;
+        }
+
+        armTimer(nullptr);
+        if (nfds > 1 && (fds[1].revents & POLLIN))
+            drainFd(wake_fd);
+        return true;
+    }
+} // namespace
+
+namespace Overlay
+{
+    void setTargetFps(double fps)
+    {
+        if (fps > 0)
+            target_fps = fps;
+    }
+
+    void setIdleFps(double fps)
+    {
+        idle_fps = fps > 0 ? fps : 0;
+    }
+
+    void markDirty()
+    {
+        // Only the first change since the last frame needs to wake the loop
+        if (!content_dirty.exchange(true) && wake_fd >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t n = write(wake_fd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    void waitForNextFrame()
+    {
+        // Before content_dirty is read, so a markDirty after that always has an fd to signal
+        ensureFds();
+
+        Clock::time_point now = Clock::now();
+        Clock::duration frame_interval = intervalFor(target_fps);
+        if (!have_deadline)
+        {
+            last_deadline = now;
+            have_deadline = true;
+        }
+
+        // Deadlines are absolute, so time spent drawing does not add drift.
+        // A frame that ran badly late resyncs instead of bursting to catch up.
+        Clock::time_point next = last_deadline + frame_interval;
+        if (next + frame_interval < now)
+            next = now;
+        waitUntil(&next, false);
+        last_deadline = next;
+
+        if (!content_dirty.load())
+        {
+            // Nothing changed: tick at the idle rate, or only on input/new content
+            bool woken;
+            if (idle_fps > 0)
+            {
+                Clock::time_point idle_deadline = next + intervalFor(idle_fps) - frame_interval;
+                woken = waitUntil(&idle_deadline, true);
+                last_deadline = woken ? Clock::now() : idle_deadline;
+            }
+            else
+            {
+                waitUntil(nullptr, true);
+                last_deadline = Clock::now();
+            }
+        }
+
+        // The wakeup of a markDirty consumed here would otherwise end the next idle wait for nothing
+        if (content_dirty.exchange(false) && wake_fd >= 0)
+            drainFd(wake_fd);
+    }
+} // namespace Overlay
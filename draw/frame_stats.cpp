@@ -0,0 +1,258 @@
+#include "frame_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <string>
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Log-linear histogram: exact below 16, then 8 buckets per power of two,
+    // which keeps percentiles within ~12% of the true value
+    const int LINEAR_BUCKETS = 16;
+    const int SUB_BUCKETS = 8;
+    const int HISTOGRAM_BUCKETS = LINEAR_BUCKETS + (64 - 4) * SUB_BUCKETS;
+
+    struct Histogram
+    {
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t samples;
+        uint64_t max;
+        double sum;
+    };
+
+    int bucketIndex(uint64_t value)
+    {
+        if (value < LINEAR_BUCKETS)
+            return static_cast<int>(value);
+
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = static_cast<int>((value >> (exponent - 3)) & (SUB_BUCKETS - 1));
+        return LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub;
+    }
+
+    // Midpoint of the values that land in a bucket
+    double bucketValue(int index)
+    {
+        if (index < LINEAR_BUCKETS)
+            return index;
+
+        int exponent = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 4;
+        int sub = (index - LINEAR_BUCKETS) % SUB_BUCKETS;
+        double width = static_cast<double>(uint64_t(1) << (exponent - 3));
+        return (SUB_BUCKETS + sub) * width + width / 2;
+    }
+
+    void record(Histogram& h, uint64_t value)
+    {
+        h.buckets[bucketIndex(value)]++;
+        h.samples++;
+        h.max = std::max(h.max, value);
+        h.sum += static_cast<double>(value);
+    }
+
+    double percentile(const Histogram& h, double q)
+    {
+        if (!h.samples)
+            return 0;
+
+        uint64_t rank = static_cast<uint64_t>(q * (h.samples - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            seen += h.buckets[i];
+            if (seen >= rank)
+                return std::min(bucketValue(i), static_cast<double>(h.max));
+        }
+        return static_cast<double>(h.max);
+    }
+
+    const char* const metric_names[Overlay::METRIC_COUNT] = {
+        "frame", "geometry", "clear", "draw_plain", "draw_outline",
+        "draw_background", "text_layout", "raster", "present", "x_requests", "round_trips"};
+
+    bool stats_enabled = false;
+    Histogram histograms[Overlay::METRIC_COUNT];
+    uint64_t frame_values[Overlay::METRIC_COUNT]; // Nanoseconds or counts since the last frame
+
+    // Open phases, innermost last; only the innermost one is accumulating
+    const int MAX_PHASE_DEPTH = 16;
+    Overlay::FrameMetric phase_stack[MAX_PHASE_DEPTH];
+    Clock::time_point phase_started;
+    int phase_depth = 0;
+
+    Clock::time_point frame_started;
+    bool frame_open = false;
+    unsigned long last_request = 0;
+    bool have_last_request = false;
+
+    std::string dump_path;
+    Clock::duration dump_interval;
+    Clock::time_point next_dump;
+
+    bool isTimeMetric(int metric)
+    {
+        return metric != Overlay::METRIC_X_REQUESTS && metric != Overlay::METRIC_ROUND_TRIPS;
+    }
+
+    void pauseInnermost(Clock::time_point now)
+    {
+        if (phase_depth > 0)
+        {
+            frame_values[phase_stack[phase_depth - 1]] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                               now - phase_started).count();
+        }
+        phase_started = now;
+    }
+
+    Overlay::MetricSummary summarize(int metric)
+    {
+        const Histogram& h = histograms[metric];
+        double scale = isTimeMetric(metric) ? 1e-3 : 1.0; // Report times in microseconds
+
+        Overlay::MetricSummary summary;
+        summary.samples = h.samples;
+        summary.mean = h.samples ? h.sum / h.samples * scale : 0;
+        summary.p50 = percentile(h, 0.50) * scale;
+        summary.p99 = percentile(h, 0.99) * scale;
+        summary.max = h.max * scale;
+        return summary;
+    }
+
+    void clearHistograms()
+    {
+        for (Histogram& h : histograms)
+            h = Histogram();
+    }
+
+    void writeDump()
+    {
+        std::ofstream out(dump_path, std::ios::app);
+        if (!out)
+            return;
+
+        out << "{\"timestamp\":" << std::time(nullptr) << ",\"frames\":" << histograms[Overlay::METRIC_FRAME].samples
+            << ",\"metrics\":{";
+        for (int i = 0; i < Overlay::METRIC_COUNT; i++)
+        {
+            Overlay::MetricSummary s = summarize(i);
+            out << (i ? "," : "") << "\"" << metric_names[i] << "\":{\"mean\":" << s.mean << ",\"p50\":" << s.p50
+                << ",\"p99\":" << s.p99 << ",\"max\":" << s.max << "}";
+        }
+        out << "}}\n";
+    }
+} // namespace
+
+namespace FrameStats
+{
+    ScopedPhase::ScopedPhase(Overlay::FrameMetric phase)
+        : active(stats_enabled && phase_depth < MAX_PHASE_DEPTH)
+    {
+        if (!active)
+            return;
+
+        pauseInnermost(Clock::now());
+        phase_stack[phase_depth++] = phase;
+    }
+
+    ScopedPhase::~ScopedPhase()
+    {
+        if (!active)
+            return;
+
+        pauseInnermost(Clock::now());
+        phase_depth--;
+    }
+
+    void countRoundTrip()
+    {
+        if (stats_enabled)
+            frame_values[Overlay::METRIC_ROUND_TRIPS]++;
+    }
+
+    void beginFrame()
+    {
+        if (!stats_enabled)
+            return;
+
+        frame_started = Clock::now();
+        frame_open = true;
+    }
+
+    void endFrame(unsigned long next_request)
+    {
+        if (!stats_enabled || !frame_open)
+            return;
+
+        Clock::time_point now = Clock::now();
+        frame_open = false;
+        frame_values[Overlay::METRIC_FRAME] =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - frame_started).count();
+
+        // Request serials are per connection and only grow, so the difference
+        // covers everything sent since the previous frame, geometry included
+        if (have_last_request && next_request >= last_request)
+            frame_values[Overlay::METRIC_X_REQUESTS] = next_request - last_request;
+        last_request = next_request;
+        have_last_request = true;
+
+        for (int i = 0; i < Overlay::METRIC_COUNT; i++)
+        {
+            record(histograms[i], frame_values[i]);
+            frame_values[i] = 0;
+        }
+
+        if (!dump_path.empty() && now >= next_dump)
+        {
+            writeDump();
+            clearHistograms();
+            next_dump = now + dump_interval;
+        }
+    }
+} // namespace FrameStats
+
+namespace Overlay
+{
+    void setFrameStatsEnabled(bool enabled)
+    {
+        stats_enabled = enabled;
+        frame_open = false;
+        have_last_request = false;
+    }
+
+    MetricSummary getFrameMetric(FrameMetric metric)
+    {
+        if (metric < 0 || metric >= METRIC_COUNT)
+            return MetricSummary();
+        return summarize(metric);
+    }
+
+    void resetFrameStats()
+    {
+        clearHistograms();
+        std::fill(frame_values, frame_values + METRIC_COUNT, 0);
+    }
+
+    bool setFrameStatsDump(const char* path, double interval_seconds)
+    {
+        if (!path || !*path || interval_seconds <= 0)
+        {
+            dump_path.clear();
+            return true;
+        }
+
+        std::ofstream probe(path, std::ios::app);
+        if (!probe)
+            return false;
+
+        dump_path = path;
+        dump_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(interval_seconds));
+        next_dump = Clock::now() + dump_interval;
+        setFrameStatsEnabled(true);
+        return true;
+    }
+} // namespace Overlay
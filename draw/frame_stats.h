@@ -0,0 +1,23 @@
+#pragma once
+#include "draw.h"
+
+// Backend hooks for the frame instrumentation in draw.h. All of them are
+// cheap no-ops while the stats are disabled.
+namespace FrameStats
+{
+    // Times its scope into one of the phase metrics. Nested scopes pause the
+    // enclosing one, so every phase reports exclusive time.
+    class ScopedPhase
+    {
+    public:
+        explicit ScopedPhase(Overlay::FrameMetric phase);
+        ~ScopedPhase();
+
+    private:
+        bool active;
+    };
+
+    void countRoundTrip();
+    void beginFrame();
+    void endFrame(unsigned long next_request); // NextRequest(display) after the frame was sent
+} // namespace FrameStats
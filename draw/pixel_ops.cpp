@@ -0,0 +1,308 @@
+#include "pixel_ops.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_OPS_X86 1
+#endif
+
+namespace
+{
+    typedef void (*ClearRow)(uint32_t* dst, int count);
+    typedef void (*CopyRow)(uint32_t* dst, const uint32_t* src, int count);
+    typedef void (*OverRow)(uint32_t* dst, const uint32_t* src, int count);
+
+    struct RowKernels
+    {
+        ClearRow clear;
+        CopyRow copy;
+        OverRow over;
+    };
+
+    std::atomic<int> selected_kernel(PixelOps::KERNEL_AUTO);
+
+    // Exact x * a / 255 for two channels at once, as 0x00XX00XX
+    inline uint32_t scaleChannels(uint32_t channels, uint32_t a)
+    {
+        uint32_t t = channels * a + 0x00800080;
+        return ((t + ((t >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    }
+
+    inline uint32_t overPixel(uint32_t src, uint32_t dst)
+    {
+        uint32_t inverse = 255 - (src >> 24);
+        if (inverse == 0)
+            return src;
+        // Premultiplied channels never exceed alpha, so the sum cannot carry
+        return src + scaleChannels(dst & 0x00ff00ff, inverse) +
+               (scaleChannels((dst >> 8) & 0x00ff00ff, inverse) << 8);
+    }
+
+    void clearRowScalar(uint32_t* dst, int count)
+    {
+        for (int i = 0; i < count; i++)
+            dst[i] = 0;
+    }
+
+    void copyRowScalar(uint32_t* dst, const uint32_t* src, int count)
+    {
+        for (int i = 0; i < count; i++)
+            dst[i] = src[i];
+    }
+
+    void overRowScalar(uint32_t* dst, const uint32_t* src, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (src[i] == 0)
+                continue;
+            dst[i] = overPixel(src[i], dst[i]);
+        }
+    }
+
+#ifdef PIXEL_OPS_X86
+    __attribute__((target("sse2"))) void clearRowSse2(uint32_t* dst, int count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), zero);
+        for (; i < count; i++)
+            dst[i] = 0;
+    }
+
+    __attribute__((target("sse2"))) void copyRowSse2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                             _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        for (; i < count; i++)
+            dst[i] = src[i];
+    }
+
+    // Four pixels widened to 16 bits per channel: dst * (255 - alpha) / 255 + src
+    __attribute__((target("sse2"))) void overRowSse2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i alpha_mask = _mm_set1_epi32(static_cast<int>(0xff000000));
+        const __m128i max = _mm_set1_epi16(255);
+        const __m128i bias = _mm_set1_epi16(128);
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+                continue;
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha_mask), alpha_mask)) == 0xffff)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), s);
+                continue;
+            }
+
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+            __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+            __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+            __m128i a_lo =
+                _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            __m128i a_hi =
+                _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+            __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(max, a_lo)), bias);
+            __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(max, a_hi)), bias);
+            t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+            t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+            __m128i result = _mm_add_epi8(_mm_packus_epi16(t_lo, t_hi), s);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), result);
+        }
+        overRowScalar(dst + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx2"))) void clearRowAvx2(uint32_t* dst, int count)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), zero);
+        for (; i < count; i++)
+            dst[i] = 0;
+    }
+
+    __attribute__((target("avx2"))) void copyRowAvx2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        int i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        for (; i < count; i++)
+            dst[i] = src[i];
+    }
+
+    // Same as the SSE2 kernel, eight pixels at a time; unpack and pack both
+    // work within 128-bit lanes, so pixel order survives the round trip
+    __attribute__((target("avx2"))) void overRowAvx2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i alpha_mask = _mm256_set1_epi32(static_cast<int>(0xff000000));
+        const __m256i max = _mm256_set1_epi16(255);
+        const __m256i bias = _mm256_set1_epi16(128);
+        const __m256i alpha_shuffle =
+            _mm256_setr_epi8(6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+                             6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+        int i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            if (_mm256_testz_si256(s, s))
+                continue;
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alpha_mask), alpha_mask)) == -1)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), s);
+                continue;
+            }
+
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+            __m256i a_lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi8(s, zero), alpha_shuffle);
+            __m256i a_hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi8(s, zero), alpha_shuffle);
+
+            __m256i t_lo =
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(max, a_lo)), bias);
+            __m256i t_hi =
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(max, a_hi)), bias);
+            t_lo = _mm256_srli_epi16(_mm256_add_epi16(t_lo, _mm256_srli_epi16(t_lo, 8)), 8);
+            t_hi = _mm256_srli_epi16(_mm256_add_epi16(t_hi, _mm256_srli_epi16(t_hi, 8)), 8);
+
+            __m256i result = _mm256_add_epi8(_mm256_packus_epi16(t_lo, t_hi), s);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), result);
+        }
+        overRowScalar(dst + i, src + i, count - i);
+    }
+#endif
+
+    bool cpuSupports(PixelOps::Kernel kernel)
+    {
+        switch (kernel)
+        {
+        case PixelOps::KERNEL_SCALAR:
+            return true;
+#ifdef PIXEL_OPS_X86
+        case PixelOps::KERNEL_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case PixelOps::KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+        }
+    }
+
+    PixelOps::Kernel bestKernel()
+    {
+        static const PixelOps::Kernel best = cpuSupports(PixelOps::KERNEL_AVX2)   ? PixelOps::KERNEL_AVX2
+                                             : cpuSupports(PixelOps::KERNEL_SSE2) ? PixelOps::KERNEL_SSE2
+                                                                                  : PixelOps::KERNEL_SCALAR;
+        return best;
+    }
+
+    RowKernels rowKernels()
+    {
+        switch (PixelOps::getKernel())
+        {
+#ifdef PIXEL_OPS_X86
+        case PixelOps::KERNEL_AVX2:
+            return {clearRowAvx2, copyRowAvx2, overRowAvx2};
+        case PixelOps::KERNEL_SSE2:
+            return {clearRowSse2, copyRowSse2, overRowSse2};
+#endif
+        default:
+            return {clearRowScalar, copyRowScalar, overRowScalar};
+        }
+    }
+
+    uint32_t* row(unsigned char* data, int stride, int y)
+    {
+        return reinterpret_cast<uint32_t*>(data + static_cast<long>(stride) * y);
+    }
+
+    const uint32_t* row(const unsigned char* data, int stride, int y)
+    {
+        return reinterpret_cast<const uint32_t*>(data + static_cast<long>(stride) * y);
+    }
+} // namespace
+
+namespace PixelOps
+{
+    bool setKernel(Kernel kernel)
+    {
+        if (kernel != KERNEL_AUTO && !cpuSupports(kernel))
+            return false;
+        selected_kernel.store(kernel);
+        return true;
+    }
+
+    Kernel getKernel()
+    {
+        Kernel kernel = static_cast<Kernel>(selected_kernel.load());
+        return kernel == KERNEL_AUTO ? bestKernel() : kernel;
+    }
+
+    const char* kernelName(Kernel kernel)
+    {
+        switch (kernel)
+        {
+        case KERNEL_SCALAR:
+            return "scalar";
+        case KERNEL_SSE2:
+            return "sse2";
+        case KERNEL_AVX2:
+            return "avx2";
+        default:
+            return "auto";
+        }
+    }
+
+    void clear(unsigned char* dst, int stride, int width, int height)
+    {
+        if (width <= 0 || height <= 0)
+            return;
+
+        ClearRow clear_row = rowKernels().clear;
+        if (stride == width * 4)
+        {
+            // Whole rows: one long run instead of height short ones
+            clear_row(row(dst, stride, 0), width * height);
+            return;
+        }
+        for (int y = 0; y < height; y++)
+            clear_row(row(dst, stride, y), width);
+    }
+
+    void copy(unsigned char* dst, int dst_stride, const unsigned char* src, int src_stride, int width, int height)
+    {
+        if (width <= 0 || height <= 0)
+            return;
+
+        CopyRow copy_row = rowKernels().copy;
+        if (dst_stride == width * 4 && src_stride == dst_stride)
+        {
+            copy_row(row(dst, dst_stride, 0), row(src, src_stride, 0), width * height);
+            return;
+        }
+        for (int y = 0; y < height; y++)
+            copy_row(row(dst, dst_stride, y), row(src, src_stride, y), width);
+    }
+
+    void over(unsigned char* dst, int dst_stride, const unsigned char* src, int src_stride, int width, int height)
+    {
+        if (width <= 0 || height <= 0)
+            return;
+
+        OverRow over_row = rowKernels().over;
+        for (int y = 0; y < height; y++)
+            over_row(row(dst, dst_stride, y), row(src, src_stride, y), width);
+    }
+} // namespace PixelOps
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+// Rectangle kernels for premultiplied ARGB32 buffers, the format cairo image
+// surfaces use. Pointers address the top-left pixel of the rectangle and
+// strides are in bytes. The widest kernel the CPU supports is used unless
+// another one is selected; all of them may run on several threads at once.
+namespace PixelOps
+{
+    enum Kernel
+    {
+        KERNEL_AUTO,
+        KERNEL_SCALAR,
+        KERNEL_SSE2,
+        KERNEL_AVX2
+    };
+
+    bool setKernel(Kernel kernel); // False if the CPU lacks it, the selection is then unchanged
+    Kernel getKernel();            // Never KERNEL_AUTO
+    const char* kernelName(Kernel kernel);
+
+    void clear(unsigned char* dst, int stride, int width, int height);
+    void copy(unsigned char* dst, int dst_stride, const unsigned char* src, int src_stride, int width, int height);
+    // dst = src + dst * (1 - src alpha)
+    void over(unsigned char* dst, int dst_stride, const unsigned char* src, int src_stride, int width, int height);
+} // namespace PixelOps
@@ -0,0 +1,247 @@
+#include "render_queue.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct QueuedFrame
+    {
+        std::vector<Draw::TextElement> commands;
+    };
+
+    // One per producer thread: a triple buffer, so submitting and consuming
+    // never wait on each other. The producer fills slots[write_index], the
+    // render thread reads slots[read_index], and `shared` holds the third
+    // slot plus a flag saying it carries a frame the consumer has not seen.
+    struct Producer
+    {
+        static const unsigned FRESH = 4;
+
+        QueuedFrame slots[3];
+        unsigned write_index = 0;          // Producer only
+        unsigned read_index = 1;           // Render thread only
+        std::atomic<unsigned> shared{2};
+        std::atomic<bool> retired{false};  // Owning thread exited, node is up for reuse
+        Producer* next = nullptr;          // Immutable once published
+    };
+
+    std::atomic<Producer*> producers(nullptr); // Push-only list, nodes are reused
+    std::atomic<bool> threaded(false);
+    std::atomic<bool> render_running(false);
+    std::thread render_thread;
+    thread_local bool on_render_thread = false;
+
+    void publish(Producer* p)
+    {
+        unsigned previous = p->shared.exchange(p->write_index | Producer::FRESH, std::memory_order_acq_rel);
+        p->write_index = previous & 3;
+        p->slots[p->write_index].commands.clear(); // Keeps capacity for the next frame
+    }
+
+    Producer* claimProducer()
+    {
+        // Take over a node left behind by an exited thread before growing the list
+        for (Producer* p = producers.load(std::memory_order_acquire); p; p = p->next)
+        {
+            bool expected = true;
+            if (p->retired.load(std::memory_order_relaxed) &&
+                p->retired.compare_exchange_strong(expected, false, std::memory_order_acq_rel))
+                return p;
+        }
+
+        Producer* p = new Producer();
+        p->next = producers.load(std::memory_order_relaxed);
+        while (!producers.compare_exchange_weak(p->next, p, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+        return p;
+    }
+
+    struct ProducerHandle
+    {
+        Producer* producer = nullptr;
+
+        ~ProducerHandle()
+        {
+            if (!producer)
+                return;
+
+            // Leave an empty frame behind, so a thread reusing the node starts clean
+            producer->slots[producer->write_index].commands.clear();
+            publish(producer);
+            producer->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    thread_local ProducerHandle local_producer;
+
+    QueuedFrame* captureFrame()
+    {
+        if (!threaded.load(std::memory_order_acquire) || on_render_thread)
+            return nullptr;
+
+        if (!local_producer.producer)
+            local_producer.producer = claimProducer();
+        Producer* p = local_producer.producer;
+        return &p->slots[p->write_index];
+    }
+
+    void replayCommand(const Draw::TextElement& cmd)
+    {
+        const char* family = cmd.font_family.empty() ? nullptr : cmd.font_family.c_str();
+        switch (cmd.style)
+        {
+        case Draw::STYLE_PLAIN:
+            Draw::drawStringPlain(cmd.text, cmd.x, cmd.y, cmd.r, cmd.g, cmd.b, family, cmd.font_size, cmd.alignment);
+            break;
+        case Draw::STYLE_OUTLINE:
+            Draw::drawStringOutline(cmd.text, cmd.x, cmd.y, cmd.r, cmd.g, cmd.b, cmd.outline_r, cmd.outline_g,
+                                    cmd.outline_b, cmd.outline_a, cmd.outline_width, family, cmd.font_size,
+                                    cmd.alignment);
+            break;
+        case Draw::STYLE_BACKGROUND:
+            Draw::drawStringBackground(cmd.text, cmd.x, cmd.y, cmd.r, cmd.g, cmd.b, cmd.bg_r, cmd.bg_g, cmd.bg_b,
+                                       cmd.bg_a, cmd.padding, family, cmd.font_size, cmd.alignment);
+            break;
+        }
+    }
+
+    void replayFrames()
+    {
+        for (Producer* p = producers.load(std::memory_order_acquire); p; p = p->next)
+        {
+            if (p->shared.load(std::memory_order_acquire) & Producer::FRESH)
+                p->read_index = p->shared.exchange(p->read_index, std::memory_order_acq_rel) & 3;
+
+            if (p->retired.load(std::memory_order_acquire))
+                continue;
+
+            // The latest complete frame stays on screen until the producer replaces it
+            for (const Draw::TextElement& cmd : p->slots[p->read_index].commands)
+                replayCommand(cmd);
+        }
+    }
+
+    void renderLoop(std::string window_class)
+    {
+        on_render_thread = true;
+        Overlay::initialize(window_class.c_str());
+
+        while (render_running.load(std::memory_order_acquire))
+        {
+            Overlay::tryInitialize(window_class.c_str());
+            if (Overlay::isInitialized())
+            {
+                Overlay::updateWindowPosition();
+                Overlay::beginFrame();
+                replayFrames();
+                Overlay::endFrame();
+            }
+            Overlay::waitForNextFrame();
+        }
+
+        Overlay::shutdown();
+    }
+} // namespace
+
+namespace RenderQueue
+{
+    bool queuePlain(const std::string& text, int x, int y, double r, double g, double b, const char* font_family,
+                    int font_size, Draw::TextAlignment alignment)
+    {
+        QueuedFrame* frame = captureFrame();
+        if (!frame)
+            return false;
+
+        frame->commands.emplace_back();
+        Draw::TextElement& cmd = frame->commands.back();
+        cmd.text = text;
+        cmd.x = x;
+        cmd.y = y;
+        cmd.r = r;
+        cmd.g = g;
+        cmd.b = b;
+        cmd.style = Draw::STYLE_PLAIN;
+        cmd.font_family = font_family ? font_family : "";
+        cmd.font_size = font_size;
+        cmd.alignment = alignment;
+        return true;
+    }
+
+    bool queueOutline(const std::string& text, int x, int y, double r, double g, double b, double outline_r,
+                      double outline_g, double outline_b, double outline_a, double outline_width,
+                      const char* font_family, int font_size, Draw::TextAlignment alignment)
+    {
+        if (!queuePlain(text, x, y, r, g, b, font_family, font_size, alignment))
+            return false;
+
+        Draw::TextElement& cmd = captureFrame()->commands.back();
+        cmd.style = Draw::STYLE_OUTLINE;
+        cmd.outline_r = outline_r;
+        cmd.outline_g = outline_g;
+        cmd.outline_b = outline_b;
+        cmd.outline_a = outline_a;
+        cmd.outline_width = outline_width;
+        return true;
+    }
+
+    bool queueBackground(const std::string& text, int x, int y, double r, double g, double b, double bg_r,
+                         double bg_g, double bg_b, double bg_a, int padding, const char* font_family, int font_size,
+                         Draw::TextAlignment alignment)
+    {
+        if (!queuePlain(text, x, y, r, g, b, font_family, font_size, alignment))
+            return false;
+
+        Draw::TextElement& cmd = captureFrame()->commands.back();
+        cmd.style = Draw::STYLE_BACKGROUND;
+        cmd.bg_r = bg_r;
+        cmd.bg_g = bg_g;
+        cmd.bg_b = bg_b;
+        cmd.bg_a = bg_a;
+        cmd.padding = padding;
+        return true;
+    }
+} // namespace RenderQueue
+
+namespace Overlay
+{
+    bool startRenderThread(const char* window_class)
+    {
+        if (render_running.load())
+            return false;
+
+        render_running.store(true);
+        threaded.store(true, std::memory_order_release);
+        render_thread = std::thread(renderLoop, std::string(window_class ? window_class : ""));
+        return true;
+    }
+
+    void stopRenderThread()
+    {
+        if (!render_running.exchange(false))
+            return;
+
+        markDirty(); // Ends an idle wait
+        render_thread.join();
+        threaded.store(false, std::memory_order_release);
+    }
+
+    bool isRenderThreadRunning()
+    {
+        return render_running.load();
+    }
+
+    void submitFrame()
+    {
+        if (!threaded.load(std::memory_order_acquire) || on_render_thread)
+            return;
+
+        if (!local_producer.producer)
+            local_producer.producer = claimProducer();
+        publish(local_producer.producer);
+        markDirty();
+    }
+} // namespace Overlay
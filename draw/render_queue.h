@@ -0,0 +1,17 @@
+#pragma once
+#include "draw.h"
+
+// Backend hooks for threaded mode. Each queue* call returns true when the
+// command was recorded for the render thread, in which case the backend must
+// not draw it directly.
+namespace RenderQueue
+{
+    bool queuePlain(const std::string& text, int x, int y, double r, double g, double b, const char* font_family,
+                    int font_size, Draw::TextAlignment alignment);
+    bool queueOutline(const std::string& text, int x, int y, double r, double g, double b, double outline_r,
+                      double outline_g, double outline_b, double outline_a, double outline_width,
+                      const char* font_family, int font_size, Draw::TextAlignment alignment);
+    bool queueBackground(const std::string& text, int x, int y, double r, double g, double b, double bg_r,
+                         double bg_g, double bg_b, double bg_a, int padding, const char* font_family, int font_size,
+                         Draw::TextAlignment alignment);
+} // namespace RenderQueue
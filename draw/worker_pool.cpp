@@ -0,0 +1,108 @@
+#include "worker_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    std::mutex pool_mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::vector<std::thread> workers;
+    bool stop_requested = false;
+
+    // Current batch; a new one only starts after every worker finished the last
+    unsigned long long generation = 0;
+    const std::function<void(int)>* batch_task = nullptr;
+    int batch_count = 0;
+    int workers_pending = 0;
+    std::atomic<int> next_index(0);
+
+    void drain(const std::function<void(int)>& task, int count)
+    {
+        for (int i = next_index.fetch_add(1); i < count; i = next_index.fetch_add(1))
+            task(i);
+    }
+
+    void workerLoop(unsigned long long seen)
+    {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        while (true)
+        {
+            work_ready.wait(lock, [&] { return stop_requested || generation != seen; });
+            if (stop_requested)
+                return;
+
+            seen = generation;
+            const std::function<void(int)>& task = *batch_task;
+            int count = batch_count;
+            lock.unlock();
+            drain(task, count);
+            lock.lock();
+
+            if (--workers_pending == 0)
+                work_done.notify_one();
+        }
+    }
+} // namespace
+
+namespace WorkerPool
+{
+    void setThreads(int threads)
+    {
+        int wanted = threads > 1 ? threads - 1 : 0;
+        if (wanted == static_cast<int>(workers.size()))
+            return;
+
+        shutdown();
+        stop_requested = false;
+        for (int i = 0; i < wanted; i++)
+            workers.emplace_back(workerLoop, generation);
+    }
+
+    int getThreads()
+    {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    void run(int count, const std::function<void(int)>& task)
+    {
+        if (workers.empty() || count <= 1)
+        {
+            for (int i = 0; i < count; i++)
+                task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            batch_task = &task;
+            batch_count = count;
+            workers_pending = static_cast<int>(workers.size());
+            next_index.store(0);
+            generation++;
+        }
+        work_ready.notify_all();
+
+        drain(task, count);
+
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        work_done.wait(lock, [] { return workers_pending == 0; });
+        batch_task = nullptr;
+    }
+
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            stop_requested = true;
+        }
+        work_ready.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+} // namespace WorkerPool
@@ -0,0 +1,13 @@
+#pragma once
+#include <functional>
+
+// Fixed pool of rasterization threads. run() hands out task indices to the
+// workers and the calling thread alike and returns once every task is done,
+// so a frame never outlives the call that rendered it.
+namespace WorkerPool
+{
+    void setThreads(int threads); // Calling thread included; 1 or less stops the workers
+    int getThreads();
+    void run(int count, const std::function<void(int)>& task);
+    void shutdown();
+} // namespace WorkerPool
@@ -1,18 +1,82 @@
 #include "draw.h"
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
-#include <thread>
 
 int main()
 {
     std::string target_window_class = "GStreamer";
     
-    // Calculate intervals
-    int mainLoopSleepMs = 16; // ~60 FPS
-    int windowCheckIntervalMs = 1000; // Check for window every second
+    Overlay::setTargetFps(60.0);
+    Overlay::setIdleFps(4.0);
+
+    // Frame timing histograms, e.g. OVERLAY_FRAME_STATS=/tmp/overlay_stats.jsonl
+    if (const char* stats_path = std::getenv("OVERLAY_FRAME_STATS"))
+        Overlay::setFrameStatsDump(stats_path, 10.0);
 
     auto start_time = std::chrono::steady_clock::now();
-    auto lastWindowCheck = std::chrono::steady_clock::now();
+
+    // Labels are created once; each frame only updates what actually changed
+    Draw::TextElement time_label;
+    time_label.style = Draw::STYLE_BACKGROUND;
+    time_label.x = 10;
+    time_label.y = 10;
+    time_label.padding = 6;
+    Draw::ElementHandle time_element = Draw::createTextElement(time_label);
+
+    Draw::TextElement emoji_label;
+    emoji_label.text = "🔋↕️🧭\n🛰️⏱🏠";
+    emoji_label.style = Draw::STYLE_OUTLINE;
+    emoji_label.r = 0.0;
+    emoji_label.outline_width = 2.0;
+    emoji_label.font_family = "Arial";
+    emoji_label.font_size = 24;
+    emoji_label.alignment = Draw::ALIGN_RIGHT;
+    Draw::ElementHandle emoji_element = Draw::createTextElement(emoji_label);
+
+    Draw::TextElement halo_label;
+    halo_label.text = "HALO\nJA MILUJEM FICA\nTO TAM ALE MUSITE POVEDAT";
+    halo_label.r = 1.0;
+    halo_label.g = 0.5;
+    halo_label.b = 0.0;
+    halo_label.font_family = "Times New Roman";
+    halo_label.font_size = 36;
+    halo_label.alignment = Draw::ALIGN_RIGHT;
+    Draw::ElementHandle halo_element = Draw::createTextElement(halo_label);
+
+    Draw::TextElement info_label;
+    info_label.text = "FPS: 60";
+    info_label.style = Draw::STYLE_BACKGROUND;
+    info_label.r = 0.0;
+    info_label.b = 0.0;
+    info_label.padding = 6;
+    info_label.font_family = "Courier New";
+    info_label.font_size = 18;
+    Draw::ElementHandle info_element = Draw::createTextElement(info_label);
+
+    Draw::TextElement status_label;
+    status_label.text = "Active";
+    status_label.r = 0.8;
+    status_label.g = 0.8;
+    status_label.font_size = 30;
+    status_label.alignment = Draw::ALIGN_RIGHT;
+    Draw::ElementHandle status_element = Draw::createTextElement(status_label);
+
+    Draw::TextElement overlay_label;
+    overlay_label.text = "Overlay: INITIALIZED";
+    overlay_label.style = Draw::STYLE_BACKGROUND;
+    overlay_label.r = 0.0;
+    overlay_label.b = 0.0;
+    overlay_label.padding = 4;
+    overlay_label.font_family = "Courier New";
+    overlay_label.font_size = 14;
+    overlay_label.alignment = Draw::ALIGN_CENTER;
+    Draw::ElementHandle overlay_element = Draw::createTextElement(overlay_label);
+
+    // Match the label fonts in the background while waiting for the target
+    Overlay::preloadFonts({{"", 0}, {"", 30}, {"Arial", 24}, {"Times New Roman", 36}, {"Courier New", 18},
+                           {"Courier New", 14}},
+                          "0123456789 ms");
 
     std::cout << "Starting overlay test application..." << std::endl;
     std::cout << "Target window class: " << target_window_class << std::endl;
@@ -20,23 +84,11 @@ int main()
 
     while (true)
     {
-        auto loopStart = std::chrono::steady_clock::now();
-
-        // Check for window existence periodically
-        auto now = std::chrono::steady_clock::now();
-        auto timeSinceLastWindowCheck = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastWindowCheck);
-        
-        if (timeSinceLastWindowCheck.count() >= windowCheckIntervalMs)
+        // Cheap when nothing changed: discovery and loss detection are event driven
+        bool was_initialized = Overlay::isInitialized();
+        if (Overlay::tryInitialize(target_window_class.c_str()) && !was_initialized)
         {
-            if (Overlay::tryInitialize(target_window_class.c_str()))
-            {
-                std::cout << "Overlay initialized successfully!" << std::endl;
-            }
-            else if (!Overlay::isInitialized())
-            {
-                std::cout << "Waiting for target window..." << std::endl;
-            }
-            lastWindowCheck = now;
+            std::cout << "Overlay initialized successfully!" << std::endl;
         }
 
         // Only update and draw if overlay is initialized
@@ -51,44 +103,31 @@ int main()
             auto now = std::chrono::steady_clock::now();
             auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
 
-            // Different texts with different fonts and sizes
-            std::string time_text = std::to_string(ms) + " ms";
-            std::string emoji_text = "🔋↕️🧭\n🛰️⏱🏠";
-            std::string halo_text = "HALO\nJA MILUJEM FICA\nTO TAM ALE MUSITE POVEDAT";
-
-            int textWidth, textHeight;
+            int textWidth = 0, textHeight = 0;
 
             // Top-left corner with default font (left aligned)
-            Draw::getTextSize(time_text, &textWidth, &textHeight, nullptr, 0);
-            Draw::drawStringBackground(time_text, 10, 10, 1.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.6, 6, nullptr, 0, Draw::ALIGN_LEFT);
+            Draw::setElementText(time_element, std::to_string(ms) + " ms");
 
             // Top-right corner with different font (right aligned)
-            Draw::getTextSize(emoji_text, &textWidth, &textHeight, "Arial", 24);
-            Draw::drawStringOutline(emoji_text, width - 10, 10, 0, 1.0, 1.0,
-                                    0.0, 0.0, 0.0, 1.0, 2.0, "Arial", 24, Draw::ALIGN_RIGHT);
+            Draw::setElementPosition(emoji_element, width - 10, 10);
 
-            // Middle with another font (centered)
-            Draw::getTextSize(halo_text, &textWidth, &textHeight, "Times New Roman", 36);
-            Draw::drawStringPlain(halo_text,width/2 - 10, (height - textHeight) / 2,
-                                  1.0, 0.5, 0.0, "Times New Roman", 36, Draw::ALIGN_RIGHT);
+            // Middle with another font (right aligned)
+            Draw::getElementSize(halo_element, &textWidth, &textHeight);
+            Draw::setElementPosition(halo_element, width / 2 - 10, (height - textHeight) / 2);
 
             // Bottom-left corner with another font (left aligned)
-            std::string info_text = "FPS: 60";
-            Draw::getTextSize(info_text, &textWidth, &textHeight, "Courier New", 18);
-            Draw::drawStringBackground(info_text, 10, height - textHeight - 10,
-                                       0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.6, 6, "Courier New", 18, Draw::ALIGN_LEFT);
+            Draw::getElementSize(info_element, &textWidth, &textHeight);
+            Draw::setElementPosition(info_element, 10, height - textHeight - 10);
 
             // Bottom-right corner with default font but different size (right aligned)
-            std::string status_text = "Active";
-            Draw::getTextSize(status_text, &textWidth, &textHeight, nullptr, 30);
-            Draw::drawStringPlain(status_text, width - 10, height - textHeight - 10,
-                                  0.8, 0.8, 1.0, nullptr, 30, Draw::ALIGN_RIGHT);
+            Draw::getElementSize(status_element, &textWidth, &textHeight);
+            Draw::setElementPosition(status_element, width - 10, height - textHeight - 10);
 
             // Add overlay status indicator
-            std::string overlay_status = "Overlay: INITIALIZED";
-            Draw::getTextSize(overlay_status, &textWidth, &textHeight, "Courier New", 14);
-            Draw::drawStringBackground(overlay_status, width / 2, height - textHeight - 10,
-                                       0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.6, 4, "Courier New", 14, Draw::ALIGN_CENTER);
+            Draw::getElementSize(overlay_element, &textWidth, &textHeight);
+            Draw::setElementPosition(overlay_element, width / 2, height - textHeight - 10);
+
+            Draw::drawElements();
 
             Overlay::endFrame();
         }
@@ -102,15 +141,8 @@ int main()
             counter++;
         }
 
-        // Calculate sleep time to maintain the desired rate
-        auto loopEnd = std::chrono::steady_clock::now();
-        auto loopTime = std::chrono::duration_cast<std::chrono::milliseconds>(loopEnd - loopStart);
-        int sleepTime = mainLoopSleepMs - loopTime.count();
-
-        if (sleepTime > 0)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(sleepTime));
-        }
+        // Sleep until the next frame deadline, longer while nothing changes
+        Overlay::waitForNextFrame();
     }
 
     Overlay::shutdown();